@@ -1,14 +1,31 @@
+/* MAP_ANONYMOUS and madvise are neither ISO C nor strict POSIX */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stddef.h>
 #include <stdint.h>
 
 #include "arena.h"
 
+#if ARENA_HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#if ARENA_HAVE_POOL
+#include <stdatomic.h>
+#endif
+
 /* |x|x|x|x|x| | | | | | |
  *  ^         ^           ^
  *  |         |           |
  * start   current       end (one past the malloc-ed area,
  *                            shall never be referenced,
  *                            strictly for pointer arithmetic and comparison)
+ *
+ * The struct arena header sits right before start, in the same block given by
+ * the backend. The first arena also holds the struct arena_allocator itself
+ * between its header and start.
  */ 
 
 struct arena {
@@ -21,26 +38,270 @@ struct arena {
 struct arena_allocator {
     struct arena *head;   
     struct arena *tail;
+    struct arena *cursor;   /* Bump allocation happens here, arenas after it are empty */
+    size_t next_size;       /* Size of the next chunk, doubles on each grow */
+    size_t max_chunk_size;  /* next_size never goes above this */
+    enum arena_fit fit;
+    size_t used;            /* Bytes handed out, padding excluded */
+    size_t padding;         /* Bytes skipped to align blocks */
+    size_t high_water;      /* Highest used + padding so far */
+    size_t shortfall;       /* Bytes missing in the last failed allocation */
+    const struct arena_backend *backend;
+    void *backend_user;
+};
+
+#define ARENA_ROUND_UP(n) (((n) + DEFAULT_ALIGNMENT - 1) & ~(size_t)(DEFAULT_ALIGNMENT - 1))
+#define ARENA_HEADER_SIZE ARENA_ROUND_UP(sizeof(struct arena))
+#define ARENA_ALLOCATOR_SIZE ARENA_ROUND_UP(sizeof(struct arena_allocator))
+
+static void *arena_backend_malloc_alloc(void *user, size_t *size)
+{
+    (void)user;
+    return malloc(*size);
+}
+
+static void arena_backend_malloc_free(void *user, void *ptr, size_t size)
+{
+    (void)user;
+    (void)size;
+    free(ptr);
+}
+
+const struct arena_backend arena_backend_malloc = {
+    arena_backend_malloc_alloc,
+    arena_backend_malloc_free
+};
+
+/* Backs arena_allocator_new_static, its only arena is the caller's buffer */
+static void *arena_backend_none_alloc(void *user, size_t *size)
+{
+    (void)user;
+    (void)size;
+    return NULL;
+}
+
+static void arena_backend_none_free(void *user, void *ptr, size_t size)
+{
+    (void)user;
+    (void)ptr;
+    (void)size;
+}
+
+static const struct arena_backend arena_backend_none = {
+    arena_backend_none_alloc,
+    arena_backend_none_free
+};
+
+#if ARENA_HAVE_MMAP
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+static void *arena_backend_mmap_alloc(void *user, size_t *size)
+{
+    void *ptr;
+
+    (void)user;
+
+    ptr = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+#ifdef MADV_HUGEPAGE
+    /* Only a hint, fewer TLB misses when walking a big document */
+    if (*size >= ARENA_HUGEPAGE_THRESHOLD)
+        madvise(ptr, *size, MADV_HUGEPAGE);
+#endif
+
+    return ptr;
+}
+
+static void arena_backend_mmap_free(void *user, void *ptr, size_t size)
+{
+    (void)user;
+    munmap(ptr, size);
+}
+
+const struct arena_backend arena_backend_mmap = {
+    arena_backend_mmap_alloc,
+    arena_backend_mmap_free
+};
+
+#endif
+
+#if ARENA_HAVE_POOL
+
+/* A free block of the pool. Blocks are moved around in batches: the first
+ * block of a batch holds its length and the link to the next batch, the
+ * blocks of a batch are chained through next. */
+struct arena_pool_block {
+    struct arena_pool_block *next;
+    struct arena_pool_block *next_batch;
+    size_t count;
+};
+
+/* Batches only ever get pushed one at a time or taken all at once, a lone
+ * pop would need ABA protection that C11 atomics can't portably give */
+static _Atomic(struct arena_pool_block *) arena_pool_batches;
+
+static _Thread_local struct arena_pool_block *arena_pool_cache;
+static _Thread_local size_t arena_pool_cache_count;
+
+/* Pushes the chain of batches from first to last on the global list */
+static void arena_pool_push_batches(struct arena_pool_block *first,
+                                    struct arena_pool_block *last)
+{
+    struct arena_pool_block *head = atomic_load_explicit(&arena_pool_batches,
+                                                         memory_order_relaxed);
+    do {
+        last->next_batch = head;
+    } while (!atomic_compare_exchange_weak_explicit(&arena_pool_batches,
+                                                    &head,
+                                                    first,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+/* Moves the whole thread cache to the global list as one batch */
+static void arena_pool_cache_flush(void)
+{
+    if (!arena_pool_cache)
+        return;
+
+    arena_pool_cache->count = arena_pool_cache_count;
+    arena_pool_push_batches(arena_pool_cache, arena_pool_cache);
+
+    arena_pool_cache = NULL;
+    arena_pool_cache_count = 0;
+}
+
+/* Takes one batch from the global list as the thread cache, 0 if it is empty */
+static int arena_pool_cache_refill(void)
+{
+    struct arena_pool_block *batches;
+    struct arena_pool_block *last;
+
+    batches = atomic_exchange_explicit(&arena_pool_batches, NULL, memory_order_acquire);
+    if (!batches)
+        return 0;
+
+    /* Give back what this thread doesn't need, there are only a few batches */
+    if (batches->next_batch) {
+        for (last = batches->next_batch; last->next_batch; last = last->next_batch)
+            ;
+        arena_pool_push_batches(batches->next_batch, last);
+    }
+
+    arena_pool_cache = batches;
+    arena_pool_cache_count = batches->count;
+
+    return 1;
+}
+
+static void *arena_backend_pool_alloc(void *user, size_t *size)
+{
+    struct arena_pool_block *block;
+
+    (void)user;
+
+    if (*size > ARENA_POOL_BLOCK_SIZE)
+        return malloc(*size);
+
+    *size = ARENA_POOL_BLOCK_SIZE;
+    if (!arena_pool_cache && !arena_pool_cache_refill())
+        return malloc(ARENA_POOL_BLOCK_SIZE);
+
+    block = arena_pool_cache;
+    arena_pool_cache = block->next;
+    --arena_pool_cache_count;
+
+    return block;
+}
+
+static void arena_backend_pool_free(void *user, void *ptr, size_t size)
+{
+    struct arena_pool_block *block = ptr;
+
+    (void)user;
+
+    if (size != ARENA_POOL_BLOCK_SIZE) {
+        free(ptr);
+        return;
+    }
+
+    /* A full cache goes to the global list first, whichever thread the
+     * block came from, so no thread ends up hoarding blocks */
+    if (arena_pool_cache_count == ARENA_POOL_CACHE_SIZE)
+        arena_pool_cache_flush();
+
+    block->next = arena_pool_cache;
+    arena_pool_cache = block;
+    ++arena_pool_cache_count;
+}
+
+const struct arena_backend arena_backend_pool = {
+    arena_backend_pool_alloc,
+    arena_backend_pool_free
 };
 
+void arena_pool_thread_flush(void)
+{
+    arena_pool_cache_flush();
+}
+
+void arena_pool_trim(void)
+{
+    struct arena_pool_block *batch;
+    struct arena_pool_block *block;
+    struct arena_pool_block *next;
+
+    arena_pool_cache_flush();
+
+    batch = atomic_exchange_explicit(&arena_pool_batches, NULL, memory_order_acquire);
+    while (batch) {
+        struct arena_pool_block *next_batch = batch->next_batch;
+        size_t count = batch->count;
+        size_t i;
+
+        for (block = batch, i = 0; i < count; ++i) {
+            next = block->next;
+            free(block);
+            block = next;
+        }
+        batch = next_batch;
+    }
+}
+
+#endif
+
 static size_t arena_remaining_size(struct arena *a)
 {
     return a->end - a->current;
 }
 
-static struct arena *arena_new(size_t size)
+/* extra bytes are reserved between the header and start */
+static struct arena *arena_new(const struct arena_backend *backend,
+                               void *user,
+                               size_t extra,
+                               size_t size)
 {
-    struct arena *a = malloc(sizeof(struct arena));
-    if (!a)
+    struct arena *a;
+    size_t header_size = ARENA_HEADER_SIZE + extra;
+    size_t total;
+
+    if (size > SIZE_MAX - header_size)
         return NULL;
 
-    a->start = malloc(size);
-    if (!a->start) {
-        free(a);
+    /* The backend may round total up, the arena then takes all of it */
+    total = header_size + size;
+    a = backend->alloc(user, &total);
+    if (!a)
         return NULL;
-    }
+
+    a->start = (char *)a + header_size;
     a->current = a->start;
-    a->end = a->start + size;
+    a->end = (char *)a + total;
     a->next = NULL;
 
     ASAN_POISON_MEMORY_REGION(a->current, arena_remaining_size(a));
@@ -48,18 +309,21 @@ static struct arena *arena_new(size_t size)
     return a;
 }
 
-static void arena_destroy(struct arena *a)
+static void arena_destroy(const struct arena_backend *backend,
+                          void *user,
+                          struct arena *a)
 {
+    /* Whatever the backend maps next at this address must not look poisoned */
     if (a) {
-        free(a->start);
-        free(a);
+        ASAN_UNPOISON_MEMORY_REGION(a, a->end - (char *)a);
+        backend->free(user, a, a->end - (char *)a);
     }
 }
 
 static struct arena *arena_allocator_grow(struct arena_allocator* aa,
                                           size_t size)
 {
-    struct arena *a = arena_new(size);
+    struct arena *a = arena_new(aa->backend, aa->backend_user, 0, size);
     if (!a)
         return NULL;
 
@@ -69,27 +333,107 @@ static struct arena *arena_allocator_grow(struct arena_allocator* aa,
         aa->head = a;
 
     aa->tail = a;
+    aa->cursor = a;
 
     return a;
 }
 
+/* Doubles the size of the next chunk, clamped to [DEFAULT_ARENA_SIZE, max_chunk_size] */
+static void arena_allocator_next_size_step(struct arena_allocator *aa)
+{
+    if (aa->next_size < DEFAULT_ARENA_SIZE)
+        aa->next_size = DEFAULT_ARENA_SIZE;
+    else if (aa->next_size <= aa->max_chunk_size / 2)
+        aa->next_size *= 2;
+    else
+        aa->next_size = aa->max_chunk_size;
+}
+
 struct arena_allocator *arena_allocator_new(size_t size)
+{
+    return arena_allocator_new_with(size, NULL, NULL);
+}
+
+static void arena_allocator_init(struct arena_allocator *aa,
+                                 struct arena *a,
+                                 const struct arena_backend *backend,
+                                 void *user)
+{
+    aa->backend = backend;
+    aa->backend_user = user;
+
+    aa->head = a;
+    aa->tail = a;
+    aa->cursor = a;
+    aa->max_chunk_size = DEFAULT_ARENA_MAX_CHUNK_SIZE;
+    aa->next_size = a->end - a->start;
+    arena_allocator_next_size_step(aa);
+    aa->fit = ARENA_FIT_BUMP;
+    aa->used = 0;
+    aa->padding = 0;
+    aa->high_water = 0;
+    aa->shortfall = 0;
+}
+
+struct arena_allocator *arena_allocator_new_with(size_t size,
+                                                 const struct arena_backend *backend,
+                                                 void *user)
 {
     struct arena *a;
     struct arena_allocator *aa;
 
-    aa = malloc(sizeof(struct arena_allocator));
+    if (!backend)
+        backend = &arena_backend_malloc;
+
+    /* One block for both the allocator and its first arena */
+    a = arena_new(backend, user, ARENA_ALLOCATOR_SIZE, size);
+    if (!a)
+        return NULL;
+
+    aa = (struct arena_allocator *)((char *)a + ARENA_HEADER_SIZE);
+    arena_allocator_init(aa, a, backend, user);
+
+    return aa;
+}
+
+#if ARENA_HAVE_POOL
+struct arena_allocator *arena_allocator_new_pooled(void)
+{
+    struct arena_allocator *aa;
+
+    aa = arena_allocator_new_with(ARENA_POOL_BLOCK_SIZE - ARENA_HEADER_SIZE - ARENA_ALLOCATOR_SIZE,
+                                  &arena_backend_pool,
+                                  NULL);
     if (!aa)
         return NULL;
 
-    a = arena_new(size);
-    if (!a) {
-        free(aa);
+    /* Keeps every arena grown afterwards within a single block */
+    arena_allocator_set_max_chunk_size(aa, ARENA_POOL_BLOCK_SIZE - ARENA_HEADER_SIZE);
+
+    return aa;
+}
+#endif
+
+struct arena_allocator *arena_allocator_new_static(void *buffer, size_t size)
+{
+    size_t pad = -(uintptr_t)buffer & (DEFAULT_ALIGNMENT - 1);
+    struct arena *a;
+    struct arena_allocator *aa;
+
+    if (!buffer || size < pad + ARENA_HEADER_SIZE + ARENA_ALLOCATOR_SIZE)
         return NULL;
-    }
 
-    aa->head = a;
-    aa->tail = a;
+    /* Same layout as a block given by a backend */
+    a = (struct arena *)((char *)buffer + pad);
+    a->start = (char *)a + ARENA_HEADER_SIZE + ARENA_ALLOCATOR_SIZE;
+    a->current = a->start;
+    a->end = (char *)buffer + size;
+    a->next = NULL;
+
+    ASAN_POISON_MEMORY_REGION(a->current, arena_remaining_size(a));
+
+    aa = (struct arena_allocator *)((char *)a + ARENA_HEADER_SIZE);
+    arena_allocator_init(aa, a, &arena_backend_none, NULL);
 
     return aa;
 }
@@ -98,51 +442,217 @@ void arena_allocator_destroy(struct arena_allocator *aa)
 {
     struct arena *ar;
     struct arena *prev_ar;
+    const struct arena_backend *backend;
+    void *user;
     if (aa) {
+        /* aa lives in the head arena, so it is gone after the first free */
+        backend = aa->backend;
+        user = aa->backend_user;
         ar = aa->head;
         while (ar) {
             prev_ar = ar; 
             ar = ar->next;
-            arena_destroy(prev_ar);
+            arena_destroy(backend, user, prev_ar);
         }
-        free(aa);
     }
 }
 
+void arena_allocator_reset(struct arena_allocator *aa, size_t retain_size)
+{
+    struct arena *ar = aa->head;
+    struct arena *prev_ar = NULL;
+    size_t retained = 0;
+    size_t size;
+
+    while (ar) {
+        size = ar->end - ar->start;
+        /* The first arena is always kept, whatever its size, aa lives there */
+        if (prev_ar && (retained > retain_size || size > retain_size - retained))
+            break;
+
+        retained += size;
+        ar->current = ar->start;
+        ASAN_POISON_MEMORY_REGION(ar->current, arena_remaining_size(ar));
+        prev_ar = ar;
+        ar = ar->next;
+    }
+
+    prev_ar->next = NULL;
+    while (ar) {
+        struct arena *next = ar->next;
+        arena_destroy(aa->backend, aa->backend_user, ar);
+        ar = next;
+    }
+
+    aa->tail = prev_ar;
+    aa->cursor = aa->head;
+    aa->used = 0;
+    aa->padding = 0;
+}
+
+struct arena_mark arena_allocator_mark(struct arena_allocator *aa)
+{
+    struct arena_mark mark;
+    mark.arena = aa->cursor;
+    mark.current = aa->cursor->current;
+    mark.used = aa->used;
+    mark.padding = aa->padding;
+
+    return mark;
+}
+
+void arena_allocator_rollback_to(struct arena_allocator *aa,
+                                 struct arena_mark mark)
+{
+    struct arena *ar = mark.arena;
+
+    ASSERT(mark.current >= ar->start && mark.current <= ar->end);
+
+    ar->current = mark.current;
+    ASAN_POISON_MEMORY_REGION(ar->current, arena_remaining_size(ar));
+
+    /* Everything past the marked arena was allocated after the mark */
+    for (ar = ar->next; ar; ar = ar->next) {
+        ar->current = ar->start;
+        ASAN_POISON_MEMORY_REGION(ar->current, arena_remaining_size(ar));
+    }
+
+    aa->cursor = mark.arena;
+    aa->used = mark.used;
+    aa->padding = mark.padding;
+}
+
+void arena_allocator_get_stats(const struct arena_allocator *aa,
+                               struct arena_allocator_stats *stats)
+{
+    const struct arena *ar;
+    size_t size;
+    /* Bump allocation never goes back to the arenas before the cursor */
+    int before_cursor = 1;
+
+    stats->used = aa->used;
+    stats->padding = aa->padding;
+    stats->high_water = aa->high_water;
+    stats->reserved = 0;
+    stats->tail_waste = 0;
+    stats->chunk_count = 0;
+    stats->largest_chunk = 0;
+
+    for (ar = aa->head; ar; ar = ar->next) {
+        if (ar == aa->cursor)
+            before_cursor = 0;
+
+        size = ar->end - ar->start;
+        stats->reserved += size;
+        if (size > stats->largest_chunk)
+            stats->largest_chunk = size;
+        if (before_cursor)
+            stats->tail_waste += ar->end - ar->current;
+        ++stats->chunk_count;
+    }
+}
+
+void arena_allocator_set_max_chunk_size(struct arena_allocator *aa, size_t size)
+{
+    if (size < DEFAULT_ARENA_SIZE)
+        size = DEFAULT_ARENA_SIZE;
+
+    aa->max_chunk_size = size;
+    if (aa->next_size > size)
+        aa->next_size = size;
+}
+
+void arena_allocator_set_fit(struct arena_allocator *aa, enum arena_fit fit)
+{
+    aa->fit = fit;
+}
+
+/* Bumps current of a single arena, NULL if it doesn't fit */
+static void *arena_bump(struct arena_allocator *aa,
+                        struct arena *a,
+                        size_t alignment,
+                        size_t size)
+{
+    size_t pad = -(uintptr_t)a->current & (alignment - 1);
+    char *block;
+
+    if (arena_remaining_size(a) < pad || arena_remaining_size(a) - pad < size)
+        return NULL;
+
+    block = a->current + pad;
+    a->current = block + size;
+
+    aa->used += size;
+    aa->padding += pad;
+    if (aa->used + aa->padding > aa->high_water)
+        aa->high_water = aa->used + aa->padding;
+
+    ASAN_UNPOISON_MEMORY_REGION(block, size);
+
+    return block;
+}
+
 /* ASAN wants an alignment of 8 to work. Why? No idea */
 void *arena_allocator_alloc(struct arena_allocator *aa, size_t alignment, size_t size)
 {
-    size_t pad = 0;
-    size_t total = 0;
     size_t grow_size = 0;
-    struct arena *available_ar = aa->head;
+    size_t pad;
+    size_t remaining;
+    struct arena *available_ar;
     void *block = NULL;
 
     /* Alignment must always be a power of 2 */
     ASSERT((alignment & (alignment - 1)) == 0);
 
-    while (available_ar) { 
-        pad = -(uintptr_t)available_ar->current & (alignment - 1);
-        total = pad + size;
-        if (arena_remaining_size(available_ar) >= total)
-            break; 
-        available_ar = available_ar->next;
+    if (aa->fit == ARENA_FIT_FIRST) {
+        for (available_ar = aa->head; available_ar != aa->cursor; available_ar = available_ar->next) {
+            block = arena_bump(aa, available_ar, alignment, size);
+            if (block)
+                return block;
+        }
     }
 
-    if (!available_ar) {
-        /* Safer this way than using total */
-        grow_size = size + alignment;
-        if (grow_size < DEFAULT_ARENA_SIZE) 
-            grow_size = DEFAULT_ARENA_SIZE;
-        available_ar = arena_allocator_grow(aa, grow_size);
-        if (!available_ar)
-            return NULL;
+    /* Arenas after the cursor are the ones kept by arena_allocator_reset,
+     * moving past one that is too small leaves it unused until next reset */
+    while (1) {
+        block = arena_bump(aa, aa->cursor, alignment, size);
+        if (block)
+            return block;
+        if (!aa->cursor->next)
+            break;
+        aa->cursor = aa->cursor->next;
     }
 
-    block = pad + (char *)available_ar->current;
-    available_ar->current += total;
+    if (size > SIZE_MAX - alignment)
+        goto fail;
 
-    ASAN_UNPOISON_MEMORY_REGION(block, size);
-        
-    return block;
+    /* Safer this way than using total */
+    grow_size = size + alignment;
+    if (grow_size < aa->next_size) 
+        grow_size = aa->next_size;
+    available_ar = arena_allocator_grow(aa, grow_size);
+    if (!available_ar)
+        goto fail;
+
+    /* Growing geometrically keeps the chunk count logarithmic to the
+     * total size, so the tail is almost always the one that fits */
+    arena_allocator_next_size_step(aa);
+
+    return arena_bump(aa, available_ar, alignment, size);
+
+fail:
+    /* What the current arena would have needed to fit the block */
+    pad = -(uintptr_t)aa->cursor->current & (alignment - 1);
+    remaining = arena_remaining_size(aa->cursor);
+    if (remaining >= pad)
+        aa->shortfall = size - (remaining - pad);
+    else
+        aa->shortfall = size > SIZE_MAX - (pad - remaining) ? SIZE_MAX : size + (pad - remaining);
+
+    return NULL;
+}
+
+size_t arena_allocator_get_shortfall(const struct arena_allocator *aa)
+{
+    return aa->shortfall;
 }
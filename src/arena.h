@@ -31,8 +31,25 @@
 #endif
 
 
+#if defined(__unix__) || defined(__APPLE__)
+#define ARENA_HAVE_MMAP 1
+#else
+#define ARENA_HAVE_MMAP 0
+#endif
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#define ARENA_HAVE_POOL 1
+#else
+#define ARENA_HAVE_POOL 0
+#endif
+
 #define DEFAULT_ARENA_SIZE (4 * 1024)
+#define DEFAULT_ARENA_MAX_CHUNK_SIZE (64 * 1024 * 1024)
 #define DEFAULT_ALIGNMENT 8
+#define ARENA_RETAIN_ALL ((size_t)-1)
+#define ARENA_HUGEPAGE_THRESHOLD (2 * 1024 * 1024)
+#define ARENA_POOL_BLOCK_SIZE (64 * 1024)
+#define ARENA_POOL_CACHE_SIZE 16
 
 #include <stdlib.h>
 
@@ -41,21 +58,209 @@
  */
 struct arena_allocator;
 
+struct arena;
+
+/**
+ * @brief   A position inside an arena_allocator, see arena_allocator_mark.
+ */
+struct arena_mark {
+    struct arena *arena;
+    char *current;
+    size_t used, padding;
+};
+
+/**
+ * @brief   Memory usage of an arena_allocator, see arena_allocator_get_stats.
+ */
+struct arena_allocator_stats {
+    size_t used;            /* Bytes handed out by arena_allocator_alloc */
+    size_t reserved;        /* Bytes held by all arenas */
+    size_t padding;         /* Bytes skipped to align blocks */
+    size_t tail_waste;      /* Bytes left unused at the end of arenas that
+                               bump allocation moved past */
+    size_t chunk_count;     /* Number of arenas */
+    size_t largest_chunk;   /* Size of the biggest arena */
+    size_t high_water;      /* Highest used + padding reached, survives
+                               arena_allocator_reset */
+};
+
+/**
+ * @brief   Where arena_allocator_alloc looks for free space.
+ *
+ * ARENA_FIT_BUMP  only tries the last arena, constant time. This is the default.
+ * ARENA_FIT_FIRST tries every arena starting from the first one, slower but
+ *                 fills up the gaps left at the end of earlier arenas.
+ */
+enum arena_fit {
+    ARENA_FIT_BUMP,
+    ARENA_FIT_FIRST
+};
+
+/**
+ * @brief   Where the memory of every arena comes from, see arena_allocator_new_with.
+ *
+ * alloc returns *size bytes aligned to at least DEFAULT_ALIGNMENT, NULL on
+ * failure. It may hand out a bigger block, *size is then updated and the arena
+ * uses all of it. free gets back a block returned by alloc along with its final
+ * size. user is whatever was given to arena_allocator_new_with.
+ */
+struct arena_backend {
+    void *(*alloc)(void *user, size_t *size);
+    void (*free)(void *user, void *ptr, size_t size);
+};
+
+/* malloc and free, used by arena_allocator_new */
+extern const struct arena_backend arena_backend_malloc;
+
+#if ARENA_HAVE_MMAP
+/* Anonymous private mmap, arenas of ARENA_HUGEPAGE_THRESHOLD bytes or more
+ * are advised to use huge pages where MADV_HUGEPAGE is available */
+extern const struct arena_backend arena_backend_mmap;
+#endif
+
+#if ARENA_HAVE_POOL
+/* Process wide pool of ARENA_POOL_BLOCK_SIZE blocks. Each thread keeps up to
+ * ARENA_POOL_CACHE_SIZE free blocks for itself and trades the rest in batches
+ * through a lock-free global list, so a block freed on another thread than the
+ * one that took it comes back without any lock. Requests for more than a
+ * block go to malloc. */
+extern const struct arena_backend arena_backend_pool;
+#endif
+
 /**
  * @brief   Creates a new arena_allocator.
  */
 struct arena_allocator *arena_allocator_new(size_t size);
 
+/**
+ * @brief   Creates a new arena_allocator that gets its memory from backend.
+ *
+ * Every arena, including the one holding the arena_allocator itself, is a
+ * single block from backend. Any allocator can be plugged in this way (jemalloc,
+ * a NUMA local pool, ...), user is handed to each call as its context.
+ *
+ * @param   size        Size of the first arena.
+ * @param   backend     Must outlive the arena_allocator. NULL for arena_backend_malloc.
+ * @param   user        Passed as is to backend.
+ */
+struct arena_allocator *arena_allocator_new_with(size_t size,
+                                                 const struct arena_backend *backend,
+                                                 void *user);
+
+#if ARENA_HAVE_POOL
+/**
+ * @brief   Creates a new arena_allocator whose arenas all come from arena_backend_pool.
+ *
+ * Every arena is exactly one pool block, an allocation too big for a block
+ * gets its own arena from malloc. Meant for the many short lived allocators of
+ * a multi-threaded server, creating and destroying one is a couple of pointer
+ * swaps once the pool is warm.
+ */
+struct arena_allocator *arena_allocator_new_pooled(void);
+
+/**
+ * @brief   Gives the free blocks cached by the calling thread back to the pool.
+ *
+ * Call it before a thread exits, its cache would otherwise leak.
+ */
+void arena_pool_thread_flush(void);
+
+/**
+ * @brief   Frees the blocks held by the global list and by the calling thread.
+ *
+ * Blocks in use and the caches of other threads are left alone.
+ */
+void arena_pool_trim(void);
+#endif
+
+/**
+ * @brief   Creates an arena_allocator that lives entirely inside buffer.
+ *
+ * Never calls malloc nor grows, allocations that don't fit in buffer fail and
+ * arena_allocator_get_shortfall tells by how much. The allocator bookkeeping
+ * takes a few dozen bytes at the start of buffer. arena_allocator_destroy
+ * leaves buffer alone, it belongs to the caller.
+ *
+ * @return  NULL if buffer is too small to even hold the bookkeeping.
+ */
+struct arena_allocator *arena_allocator_new_static(void *buffer, size_t size);
+
 /**
  * @brief   Destroy given arena_allocator and all arena inside of it.
  */
 void arena_allocator_destroy(struct arena_allocator *aa);
 
+/**
+ * @brief   Empties arena_allocator without giving its memory back.
+ *
+ * Every allocation made so far is invalidated and the arenas are reused by the
+ * following allocations, which saves the malloc/free pair of a new allocator
+ * when one is used over and over (e.g. one document after another).
+ *
+ * @param   aa          The arena allocator.
+ * @param   retain_size Arenas are kept in order as long as their total size stays
+ *                      within retain_size, the rest are freed. The first arena is
+ *                      always kept. ARENA_RETAIN_ALL keeps everything.
+ */
+void arena_allocator_reset(struct arena_allocator *aa, size_t retain_size);
+
+/**
+ * @brief   Returns how many more bytes the last failed allocation needed.
+ *
+ * Counted against the free space of the current arena, 0 if no allocation
+ * failed yet. Mostly useful with arena_allocator_new_static.
+ */
+size_t arena_allocator_get_shortfall(const struct arena_allocator *aa);
+
+/**
+ * @brief   Remembers how much of arena_allocator is in use right now.
+ *
+ * Pass the result to arena_allocator_rollback_to to free everything allocated
+ * after this call. A mark is invalidated by arena_allocator_reset and by rolling
+ * back to an earlier mark.
+ */
+struct arena_mark arena_allocator_mark(struct arena_allocator *aa);
+
+/**
+ * @brief   Frees every allocation made after mark was taken.
+ *
+ * The memory goes back to arena_allocator for the following allocations, the
+ * allocations made before mark stay valid. With ARENA_FIT_FIRST, allocations
+ * that landed in the free space of an arena before the marked one are not
+ * given back until the next reset.
+ */
+void arena_allocator_rollback_to(struct arena_allocator *aa,
+                                 struct arena_mark mark);
+
+/**
+ * @brief   Fills stats with the memory usage of arena_allocator.
+ *
+ * Walks every arena, cheap as long as there are only a few of them.
+ */
+void arena_allocator_get_stats(const struct arena_allocator *aa,
+                               struct arena_allocator_stats *stats);
+
+/**
+ * @brief   Caps the size of the arenas created when arena_allocator grows.
+ *
+ * Each new arena is twice the size of the previous one until it reaches size.
+ * A single allocation bigger than size still gets an arena that fits it.
+ * Defaults to DEFAULT_ARENA_MAX_CHUNK_SIZE, never goes below DEFAULT_ARENA_SIZE.
+ */
+void arena_allocator_set_max_chunk_size(struct arena_allocator *aa, size_t size);
+
+/**
+ * @brief   Sets the arena_fit policy used by arena_allocator_alloc.
+ */
+void arena_allocator_set_fit(struct arena_allocator *aa, enum arena_fit fit);
+
 /**
  * @brief   Allocates size amount of bytes from the arena inside arena_allocator.
  *
  * Allocates a block of memory of the specified size and given alignment.
- * arena_allocator grows by creating a new arena if capacity is not sufficient.
+ * arena_allocator grows by creating a new arena if capacity is not sufficient,
+ * the new arena is twice as big as the previous one (see
+ * arena_allocator_set_max_chunk_size).
  *
  * @param   aa          The arena allocator.
  * @param   alignment   The block alignment to its neighboring blocks. Must be power of 2
@@ -1,7 +1,37 @@
+/* madvise is neither ISO C nor strict POSIX */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <float.h>
 #include "minjson.h"
+#include "minjson_pow10.h"
+
+#if ARENA_HAVE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if !defined(MINJSON_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define MINJSON_HAVE_AVX2 1
+#elif !defined(MINJSON_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#include <emmintrin.h>
+#define MINJSON_HAVE_SSE2 1
+#endif
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#define MINJSON_HAVE_ATOMICS 1
+#else
+#define MINJSON_HAVE_ATOMICS 0
+#endif
 
 enum minjson_type {
     MJ_OBJECT,
@@ -13,45 +43,107 @@ enum minjson_type {
     MJ_NULL
 };
 
+/* How a number is stored. Integers without fraction nor exponent are kept
+ * exact if they fit in 64 bits, everything else is a double. */
+enum minjson_number_type {
+    MJ_NUMBER_DOUBLE,
+    MJ_NUMBER_INT64,
+    MJ_NUMBER_UINT64,       /* Only integers above INT64_MAX */
+    MJ_NUMBER_LAZY,         /* Not decoded yet, see minjson_lazy_number */
+    MJ_NUMBER_DECODING      /* A lazy number some thread is caching */
+};
+
+union minjson_number {
+    double real;
+    int64_t int64;
+    uint64_t uint64;
+};
+
 struct minjson;
 
 struct minjson_value {
     enum minjson_type type;
+    enum minjson_number_type number_type; /* MJ_NUMBER only */
     union {
         struct minjson_object *object;
         struct minjson_array *array;
-        char *string;
-        double number; /* Cast to int if needed */
+        const char *string; /* See minjson_string for its length */
+        union minjson_number number;
         int boolean;
     } value;
 };
 
+/* A number parsed with lazy_numbers, allocated in place of its minjson_value
+ * whose number_type stays MJ_NUMBER_LAZY. value.number caches the number once
+ * decoded is neither MJ_NUMBER_LAZY nor MJ_NUMBER_DECODING. With atomics the
+ * first reader claims the cache and publishes decoded with release, readers
+ * load it with acquire. */
+struct minjson_lazy_number {
+    struct minjson_value value;
+#if MINJSON_HAVE_ATOMICS
+    _Atomic int decoded;
+#else
+    enum minjson_number_type decoded;
+#endif
+    const char *lexeme; /* In the raw_json given to minjson_parse_ex */
+    size_t len;
+};
+
+/* A string value, allocated in place of its minjson_value. Without escapes
+ * and with zero_copy_strings, value.string points in raw_json and is not null
+ * terminated, otherwise it is a null terminated copy. */
+struct minjson_string {
+    struct minjson_value value;
+    size_t len;
+};
 
 struct minjson_object_entry {
-    char *key;
+    const char *key; /* Same as minjson_string */
+    size_t key_len;
     struct minjson_value *value;
-    struct minjson_object_entry *next;
 };
 
-/* Any number of minjson_object_entry */
-struct minjson_object { /* This itself is value of type object */
-    struct minjson_object_entry *head;
-    struct minjson_object_entry *tail;
-    size_t len;
+/* Open addressing slot, entry is the index in entries plus one, 0 if empty */
+struct minjson_object_slot {
+    uint32_t hash;
+    uint32_t entry;
 };
 
-struct minjson_array_entry {
-    struct minjson_value *value;
-    struct minjson_array_entry *next;
+/* Any number of minjson_object_entry, stored contiguously */
+struct minjson_object { /* This itself is value of type object */
+    struct minjson_object_entry *entries;
+    size_t len;
+    /* Hash index over entries, NULL for objects below the index threshold */
+    struct minjson_object_slot *index;
+    size_t index_mask;
 };
 
-/* Any number of value(any type) */
+/* Any number of value(any type), stored contiguously */
 struct minjson_array { /* This itself is value of type array */
-    struct minjson_array_entry *head;
-    struct minjson_array_entry *tail;
+    struct minjson_value **values;
     size_t len;
 };
 
+/* A tape word is a tag in its top 8 bits and a 56 bits payload. Tags are
+ * minjson_type values plus TAPE_CLOSE.
+ *
+ * MJ_OBJECT, MJ_ARRAY          payload is the index of the matching TAPE_CLOSE,
+ *                              the next word is the number of entries or elements
+ * TAPE_CLOSE                   payload is the index of the matching open word
+ * MJ_STRING                    payload is the offset of the string in strings
+ * MJ_NUMBER                    payload is the minjson_number_type, the next
+ *                              word holds the bits of the number
+ * MJ_TRUE, MJ_FALSE, MJ_NULL   no payload
+ *
+ * Inside an object, each value is preceded by the MJ_STRING word of its key.
+ */
+#define TAPE_CLOSE 0xFF
+#define TAPE_TAG_SHIFT 56
+#define TAPE_PAYLOAD_MASK (((uint64_t)1 << TAPE_TAG_SHIFT) - 1)
+#define TAPE_WORD(tag, payload) (((uint64_t)(tag) << TAPE_TAG_SHIFT) | (payload))
+#define TAPE_TAG(word) ((unsigned int)((word) >> TAPE_TAG_SHIFT))
+#define TAPE_PAYLOAD(word) ((word) & TAPE_PAYLOAD_MASK)
+
 enum token_type {
     TK_STRING,
     TK_NUMBER,
@@ -71,6 +163,10 @@ struct minjson_token {
     const char *lexeme;
     size_t len;
     size_t line, column;
+    int escaped; /* TK_STRING only, holds at least one escape sequence */
+    /* TK_NUMBER only, decoded by the lexer */
+    enum minjson_number_type number_type;
+    union minjson_number number;
     struct minjson_token *next;
 };
 
@@ -79,7 +175,10 @@ struct minjson_lexer {
     struct minjson_token *tk_head;
     struct minjson_token *tk_tail;
     const char *current;
+    const char *end; /* One past the last byte, the nul if there is one */
     size_t pos_line, pos_column;
+    int lazy_numbers; /* Numbers are only validated, see minjson_lazy_number */
+    int partial; /* More input may follow end, see minjson_feed */
 };
 
 static int is_digit(const char c)
@@ -87,6 +186,11 @@ static int is_digit(const char c)
     return c >= '0' && c <= '9';
 }
 
+static int is_whitespace(const char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
 static int is_onenine(const char c)
 {
     return c >= '1' && c <= '9';
@@ -107,6 +211,20 @@ static int is_low_surrogate(unsigned int hex)
     return hex >= LS_LB && hex <= LS_UB;
 }
 
+/* The byte at p, or the nul a null terminated input would have at end. The
+ * lexer treats length delimited and null terminated inputs alike with it. */
+static char lexer_peek(const char *p, const char *end)
+{
+    return p < end ? *p : '\0';
+}
+
+/* Bytes a literal or a number can be made of */
+static int is_scalar_byte(const char c)
+{
+    return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           c == '+' || c == '-' || c == '.';
+}
+
 static int is_valid_literal_terminator(const char c)
 {
     return c == '\0' || c == ' ' || c == '\t' || c == '\n' ||
@@ -133,17 +251,163 @@ static void minjson_error_set(struct minjson_error *error,
     }
 }
 
+/* Tells how much was missing when aa belongs to a fixed size buffer */
+static void minjson_error_set_allocator(struct minjson_error *error,
+                                        const struct arena_allocator *aa)
+{
+    size_t shortfall = aa ? arena_allocator_get_shortfall(aa) : 0;
+
+    if (!error)
+        return;
+
+    minjson_error_set(error, MJ_ERR_ALLOCATOR, "memory allocator failed", 0, 0);
+    if (shortfall)
+        snprintf(error->message,
+                 sizeof(error->message),
+                 "memory allocator failed, needed %zu more bytes",
+                 shortfall);
+}
+
 static void lexer_advance(struct minjson_lexer *lexer, size_t step)
 {
     lexer->current += step;
     lexer->pos_column += step;
 }
 
+/* ================== SIMD ================== */
+
+/* The few vector operations the lexer needs, SIMD_WIDTH bytes at a time.
+ * Left undefined without SSE2, callers then fall back to plain loops. */
+#if MINJSON_HAVE_AVX2
+
+#define SIMD_WIDTH 32
+typedef __m256i simd_vector;
+#define simd_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define simd_splat(c) _mm256_set1_epi8(c)
+#define simd_or(a, b) _mm256_or_si256((a), (b))
+#define simd_eq(a, b) _mm256_cmpeq_epi8((a), (b))
+#define simd_max(a, b) _mm256_max_epu8((a), (b))
+#define simd_mask(v) ((uint64_t)(uint32_t)_mm256_movemask_epi8(v))
+
+#elif MINJSON_HAVE_SSE2
+
+#define SIMD_WIDTH 16
+typedef __m128i simd_vector;
+#define simd_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define simd_splat(c) _mm_set1_epi8(c)
+#define simd_or(a, b) _mm_or_si128((a), (b))
+#define simd_eq(a, b) _mm_cmpeq_epi8((a), (b))
+#define simd_max(a, b) _mm_max_epu8((a), (b))
+#define simd_mask(v) ((uint64_t)(uint16_t)_mm_movemask_epi8(v))
+
+#endif
+
+/* Index of the last set bit of a non zero x */
+static int simd_last_bit(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(x);
+#else
+    int n = 0;
+    while (x >>= 1)
+        ++n;
+    return n;
+#endif
+}
+
+#ifdef SIMD_WIDTH
+
+/* Index of the first set bit of a non zero x */
+static int simd_ctz(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+static size_t simd_popcount(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    size_t n = 0;
+    for (; x; x &= x - 1)
+        ++n;
+    return n;
+#endif
+}
+
+/* Moves lexer over the len bytes at current, newlines marks the line feeds
+ * among them */
+static void lexer_advance_lines(struct minjson_lexer *lexer,
+                                size_t len,
+                                uint64_t newlines)
+{
+    if (newlines) {
+        lexer->pos_line += simd_popcount(newlines);
+        lexer->pos_column = len - simd_last_bit(newlines);
+    } else {
+        lexer->pos_column += len;
+    }
+    lexer->current += len;
+}
+
+#endif
+
 static void lexer_skip_whitespaces(struct minjson_lexer *lexer)
 {
     const char *c = lexer->current;
+#ifdef SIMD_WIDTH
+    const simd_vector space = simd_splat(' ');
+    const simd_vector tab = simd_splat('\t');
+    const simd_vector lf = simd_splat('\n');
+    const simd_vector cr = simd_splat('\r');
+    simd_vector v;
+    uint64_t whitespace;
+    size_t spaces;
+    size_t run;
+
+    /* Minified input, nothing to skip most of the time */
+    if (!is_whitespace(lexer_peek(c, lexer->end)))
+        return;
+
+    /* Indentation of pretty printed input, a line feed then spaces */
+    if (*c == '\n') {
+        for (run = 1; lexer->end - (c + run) >= SIMD_WIDTH; run += SIMD_WIDTH) {
+            spaces = simd_ctz(~simd_mask(simd_eq(simd_load(c + run), space)));
+            if (spaces < SIMD_WIDTH) {
+                run += spaces;
+                break;
+            }
+        }
+        lexer_advance_lines(lexer, run, 1);
+        c += run;
+        if (!is_whitespace(lexer_peek(c, lexer->end)))
+            return;
+    }
+
+    for (; lexer->end - c >= SIMD_WIDTH; c += SIMD_WIDTH) {
+        v = simd_load(c);
+        whitespace = simd_mask(simd_or(simd_or(simd_eq(v, space), simd_eq(v, tab)),
+                                       simd_or(simd_eq(v, lf), simd_eq(v, cr))));
+        /* Bits past SIMD_WIDTH are set, run stops there at most */
+        run = simd_ctz(~whitespace);
+        lexer_advance_lines(lexer,
+                            run,
+                            simd_mask(simd_eq(v, lf)) & (((uint64_t)1 << run) - 1));
+        if (run < SIMD_WIDTH)
+            return;
+    }
+#endif
 
-    while (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') { 
+    while (is_whitespace(lexer_peek(c, lexer->end))) {
         if (*c == '\n') {
             lexer->pos_line += 1;
             lexer->pos_column = 1;
@@ -156,152 +420,461 @@ static void lexer_skip_whitespaces(struct minjson_lexer *lexer)
     lexer->current = c;
 }
 
-static void lexer_add_token(enum token_type type,
-                     struct minjson_lexer *lexer,
-                     size_t len)
+static void lexer_set_token(enum token_type type,
+                            struct minjson_lexer *lexer,
+                            size_t len,
+                            struct minjson_token *token)
 {
-    struct minjson_token *token = \
-        arena_allocator_alloc(lexer->aallocator,
-                              DEFAULT_ALIGNMENT,
-                              sizeof(struct minjson_token));
-
     token->type = type;
     token->lexeme = lexer->current;
     token->len = len;
     token->line = lexer->pos_line;
     token->column = lexer->pos_column;
     token->next = NULL;
+}
+
+static int lexer_add_token(struct minjson_lexer *lexer,
+                           const struct minjson_token *token)
+{
+    struct minjson_token *copy = \
+        arena_allocator_alloc(lexer->aallocator,
+                              DEFAULT_ALIGNMENT,
+                              sizeof(struct minjson_token));
+    if (!copy)
+        return -1;
+
+    *copy = *token;
 
     if (lexer->tk_tail)
-        lexer->tk_tail->next = token;
+        lexer->tk_tail->next = copy;
     else
-        lexer->tk_head = token;
+        lexer->tk_head = copy;
+
+    lexer->tk_tail = copy;
+
+    return 0;
+}
+
+/* Offset from p of the first '"', '\\' or control character, or of end.
+ * The nul at end is a control character itself. */
+static size_t lexer_scan_string(const char *p, const char *end)
+{
+    const char *start = p;
+#ifdef SIMD_WIDTH
+    const simd_vector quote = simd_splat('"');
+    const simd_vector backslash = simd_splat('\\');
+    const simd_vector control = simd_splat(0x1F);
+    simd_vector v;
+    uint64_t mask;
+
+    /* Never loads past end */
+    for (; end - p >= SIMD_WIDTH; p += SIMD_WIDTH) {
+        v = simd_load(p);
+        mask = simd_mask(simd_or(simd_or(simd_eq(v, quote), simd_eq(v, backslash)),
+                                 simd_eq(simd_max(v, control), control)));
+        if (mask)
+            return p - start + simd_ctz(mask);
+    }
+#endif
 
-    lexer->tk_tail = token;
+    while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+        ++p;
+
+    return p - start;
 }
 
-static int lexer_add_string(struct minjson_lexer *lexer)
+/* Returns 0 with lexer on the closing ", -1 if the string is unterminated,
+ * -2 with lexer on the offending byte if it holds a control character and
+ * -3 if it runs into end */
+static int lexer_add_string(struct minjson_lexer *lexer,
+                            struct minjson_token *token)
 {
     const char *current;
-    size_t backslash_count = 0;
-    size_t len = 0;
+    size_t len;
+    int escaped = 0;
 
     lexer_advance(lexer, 1); /* One past the opening " */
 
     current = lexer->current;
     while (1) {
-        /**
-         * Please forgive me for this...
-         * \\\" dquote is escaped
-         * \\"  dquote is not escaped. hence we break
-         */
-        if (*current == '"') {
-            if (*(current - 1) == '\\') {
-                if (backslash_count % 2 == 0)
-                    break;
-            } else {
-                break;
-            }
+        current += lexer_scan_string(current, lexer->end);
+
+        if (current == lexer->end)
+            return -3;
+
+        if (*current == '"')
+            break;
+
+        if (*current == '\\') {
+            /* The escaped byte is skipped along, the decoder validates it
+             * later. Unless it is a control character, caught next round. */
+            current += (unsigned char)lexer_peek(current + 1, lexer->end) < 0x20 ? 1 : 2;
+            escaped = 1;
+            continue;
         }
 
-        if (*current == '\n' || *current == '\0')
+        /* Raw control characters are not allowed in strings (RFC 8259).
+         * A line feed means the string was never closed. */
+        if (*current == '\n')
             return -1;
-        else if (*current == '\\')
-            ++backslash_count;
-        else
-            backslash_count = 0;
 
-        ++current;
-        ++len;
+        lexer_advance(lexer, current - lexer->current);
+        return -2;
     }
 
-    lexer_add_token(TK_STRING, lexer, len);
+    len = current - lexer->current;
+    lexer_set_token(TK_STRING, lexer, len, token);
+    token->escaped = escaped;
     lexer_advance(lexer, len); /* On " closing */
 
     return 0;
 }
 
-/* JSON number finite automaton states */
-/* I got ChatGPT to list the states, don't judge me :( */
-enum number_fa_state {
-    Q0_START,
-    Q1_OPT_MINUS,
-    Q2_INITIAL_ZERO,        /* Accept */
-    Q3_DIGIT,               /* Accept */
-    Q4_FRAC,
-    Q5_FRAC_DIGIT,          /* Accept */
-    Q6_EXP,
-    Q7_OPT_MINUS_PLUS,
-    Q8_EXP_DIGIT            /* Accept */
+/* ================== Numbers ================== */
+
+/* Numbers are validated and converted in the same pass. Up to 19
+ * significant digits are gathered in a uint64_t w, the value is then
+ * w * 10^q. Integers and small exponents are exact in double arithmetic
+ * (Clinger), the others go through Eisel-Lemire, which rounds correctly
+ * from a 128 bits approximation of 10^q. The few numbers neither can round
+ * (more than 19 digits sitting right on a halfway point) fall back to
+ * strtod on a copy stripped of its decimal point, the locale never
+ * matters. */
+
+#define NUMBER_MAX_DIGITS 19            /* Always fit in a uint64_t */
+#define NUMBER_MAX_EXPONENT 100000      /* Anything past it is 0 or inf anyway */
+#define NUMBER_FALLBACK_DIGITS 768      /* Enough to round any double */
+/* w * 10^q can only fall right between two doubles for q in this range */
+#define NUMBER_EVEN_MIN_EXPONENT (-4)
+#define NUMBER_EVEN_MAX_EXPONENT 23
+
+/* Clinger's fast path needs double arithmetic without extended precision */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define NUMBER_HAVE_CLINGER 1
+
+static const double number_exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
 };
-static int lexer_add_number(struct minjson_lexer *lexer)
+#endif
+
+/* High 64 bits of a * b, the low ones go in *low */
+static uint64_t number_mul128(uint64_t a, uint64_t b, uint64_t *low)
+{
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 uint128;
+    uint128 r = (uint128)a * b;
+
+    *low = (uint64_t)r;
+    return (uint64_t)(r >> 64);
+#else
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t lo_lo = a_lo * b_lo;
+    uint64_t hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+
+    *low = cross << 32 | (uint32_t)lo_lo;
+    return a_hi * b_hi + (hi_lo >> 32) + (cross >> 32);
+#endif
+}
+
+/* Eisel-Lemire, the double nearest to w * 10^q. Returns -1 in the rare
+ * cases the 128 bits approximation is too close to call. */
+static int number_eisel_lemire(uint64_t w, int q, int negative, double *out)
+{
+    uint64_t factor;
+    uint64_t hi, lo;
+    uint64_t second_hi, second_lo;
+    uint64_t upperbit;
+    uint64_t mantissa;
+    uint64_t bits;
+    int64_t exponent;
+    int lz;
+
+    if (w == 0 || q < MINJSON_POW10_MIN) {
+        bits = 0;
+        goto done;
+    }
+    if (q > MINJSON_POW10_MAX) {
+        bits = (uint64_t)0x7FF << 52;
+        goto done;
+    }
+
+    /* floor(q * log2(10)) plus the bias, the shift keeps it exact over the table */
+    exponent = (((152170 + 65536) * (int64_t)q) >> 16) + 1024 + 63;
+
+    lz = 63 - simd_last_bit(w);
+    w <<= lz;
+
+    factor = minjson_pow5_128[2 * (q - MINJSON_POW10_MIN)];
+    hi = number_mul128(w, factor, &lo);
+    if ((hi & 0x1FF) == 0x1FF && lo + w < w) {
+        /* The truncated bits could carry into the mantissa, use the low
+         * word of the power as well */
+        factor = minjson_pow5_128[2 * (q - MINJSON_POW10_MIN) + 1];
+        second_hi = number_mul128(w, factor, &second_lo);
+        lo += second_hi;
+        if (second_hi > lo)
+            ++hi;
+        if (lo == UINT64_MAX)
+            return -1;
+    }
+
+    upperbit = hi >> 63;
+    mantissa = hi >> (upperbit + 9);
+    lz += (int)(1 ^ upperbit);
+    exponent -= lz;
+
+    if (exponent <= 0) {
+        /* Subnormal */
+        if (-exponent + 1 >= 64) {
+            bits = 0;
+            goto done;
+        }
+        mantissa >>= -exponent + 1;
+        mantissa += mantissa & 1;
+        mantissa >>= 1;
+        exponent = mantissa < (uint64_t)1 << 52 ? 0 : 1;
+        bits = mantissa | (uint64_t)exponent << 52;
+        goto done;
+    }
+
+    /* Exactly halfway between two doubles, round to even */
+    if (q >= NUMBER_EVEN_MIN_EXPONENT && q <= NUMBER_EVEN_MAX_EXPONENT &&
+        lo == 0 && (hi & 0x1FF) == 0 && (mantissa & 3) == 1 &&
+        mantissa << (upperbit + 64 - 53 - 2) == hi)
+        mantissa &= ~(uint64_t)1;
+
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (uint64_t)1 << 53) {
+        mantissa = (uint64_t)1 << 52;
+        ++exponent;
+    }
+    mantissa &= ~((uint64_t)1 << 52);
+
+    if (exponent > 2046)
+        bits = (uint64_t)0x7FF << 52;
+    else
+        bits = mantissa | (uint64_t)exponent << 52;
+
+done:
+    bits |= (uint64_t)negative << 63;
+    memcpy(out, &bits, sizeof(*out));
+    return 0;
+}
+
+/* strtod on "<digits>e<exponent>" rebuilt from the number at p, no decimal
+ * point so the locale plays no part. Digits past NUMBER_FALLBACK_DIGITS only
+ * matter for being non zero, a trailing 1 stands for them. */
+static double number_fallback(const char *p, const char *end, int exponent)
 {
-    const char *curr = lexer->current;
+    char buf[1 + NUMBER_FALLBACK_DIGITS + 1 + 1 + 12];
+    char digits[12];
     size_t len = 0;
+    size_t kept = 0;
+    int sticky = 0;
+    int in_fraction = 0;
+    int n;
+
+    if (*p == '-')
+        buf[len++] = *p++;
+
+    for (; p < end && (is_digit(*p) || (*p == '.' && !in_fraction)); ++p) {
+        if (*p == '.') {
+            in_fraction = 1;
+            continue;
+        }
+        if (in_fraction)
+            --exponent;
+        if (kept == 0 && *p == '0')
+            continue;
+        if (kept < NUMBER_FALLBACK_DIGITS) {
+            buf[len++] = *p;
+            ++kept;
+        } else {
+            ++exponent;
+            sticky |= *p != '0';
+        }
+    }
+    if (sticky) {
+        buf[len++] = '1';
+        --exponent;
+    }
+    if (kept == 0)
+        buf[len++] = '0';
 
-    /* either use strtod() to validate (no idea how to save double
-     * as this is a lexer) OR handroll your own regular language parser (below) */
-    enum number_fa_state state = Q0_START;
-
-    while (!is_valid_literal_terminator(*curr)) {
-        switch (state) {
-            case Q0_START:
-                if (*curr == '-') state = Q1_OPT_MINUS;
-                else if (*curr == '0') state = Q2_INITIAL_ZERO;
-                else if (is_onenine(*curr)) state = Q3_DIGIT;
-                else return -1; 
-                break;
-            case Q1_OPT_MINUS:
-                if (*curr == '0') state = Q2_INITIAL_ZERO;
-                else if (is_onenine(*curr)) state = Q3_DIGIT;
-                else return -1;
-                break;
-            case Q2_INITIAL_ZERO:
-                if (*curr == '.') state = Q4_FRAC;
-                else if (*curr == 'e' || *curr == 'E') state = Q6_EXP;
-                else return -1;
-                break;
-            case Q3_DIGIT:
-                if (is_digit(*curr)) state = Q3_DIGIT;
-                else if (*curr == '.') state = Q4_FRAC;
-                else if (*curr == 'e' || *curr == 'E') state = Q6_EXP;
-                else return -1;
-                break;
-            case Q4_FRAC:
-                if (is_digit(*curr)) state = Q5_FRAC_DIGIT;
-                else return -1;
-                break;
-            case Q5_FRAC_DIGIT:
-                if (is_digit(*curr)) state = Q5_FRAC_DIGIT;
-                else if (*curr == 'e' || *curr == 'E') state = Q6_EXP;
-                else return -1;
-                break;
-            case Q6_EXP:
-                if (*curr == '+' || *curr == '-') state = Q7_OPT_MINUS_PLUS;
-                else if (is_digit(*curr)) state = Q8_EXP_DIGIT;
-                else return -1;
-                break;
-            case Q7_OPT_MINUS_PLUS:
-                if (is_digit(*curr)) state = Q8_EXP_DIGIT;
-                else return -1;
-                break;
-            case Q8_EXP_DIGIT:
-                if (is_digit(*curr)) state = Q8_EXP_DIGIT;
-                else return -1;
-                break;
-            default:
-                return -1;
-                break;
+    buf[len++] = 'e';
+    if (exponent < 0) {
+        buf[len++] = '-';
+        exponent = -exponent;
+    }
+    n = 0;
+    do {
+        digits[n++] = '0' + exponent % 10;
+        exponent /= 10;
+    } while (exponent);
+    while (n)
+        buf[len++] = digits[--n];
+    buf[len] = '\0';
+
+    return strtod(buf, NULL);
+}
+
+/* Validates the number at start and, if decode, converts it in number.
+ * Returns where the number ends, NULL if it is not valid. */
+static const char *number_parse(const char *start,
+                                const char *end,
+                                int decode,
+                                enum minjson_number_type *type,
+                                union minjson_number *number)
+{
+    const char *p = start;
+    const char *first_digit;
+    const char *integer_end;
+    uint64_t w = 0;
+    size_t digits = 0;
+    int truncated = 0;
+    int negative;
+    int exponent = 0;       /* Of the digits gathered in w */
+    int explicit_exponent = 0;
+    int exponent_negative = 0;
+    int q;
+    double value;
+    double other;
+
+    negative = lexer_peek(p, end) == '-';
+    p += negative;
+
+    /* The integer part, no leading zero */
+    if (lexer_peek(p, end) == '0') {
+        ++p;
+    } else if (is_onenine(lexer_peek(p, end))) {
+        for (; is_digit(lexer_peek(p, end)); ++p) {
+            if (digits < NUMBER_MAX_DIGITS) {
+                w = w * 10 + (*p - '0');
+                ++digits;
+            } else {
+                ++exponent;
+                truncated |= *p != '0';
+            }
+        }
+    } else {
+        return NULL;
+    }
+    integer_end = p;
+
+    if (lexer_peek(p, end) == '.') {
+        ++p;
+        first_digit = p;
+        for (; is_digit(lexer_peek(p, end)); ++p) {
+            if (digits < NUMBER_MAX_DIGITS) {
+                w = w * 10 + (*p - '0');
+                --exponent;
+                /* Leading zeros of 0.00x are not significant */
+                digits += w != 0;
+            } else {
+                truncated |= *p != '0';
+            }
+        }
+        if (p == first_digit)
+            return NULL;
+    }
+
+    if (lexer_peek(p, end) == 'e' || lexer_peek(p, end) == 'E') {
+        ++p;
+        if (lexer_peek(p, end) == '+' || lexer_peek(p, end) == '-')
+            exponent_negative = *p++ == '-';
+        first_digit = p;
+        for (; is_digit(lexer_peek(p, end)); ++p) {
+            if (explicit_exponent < NUMBER_MAX_EXPONENT)
+                explicit_exponent = explicit_exponent * 10 + (*p - '0');
+        }
+        if (p == first_digit)
+            return NULL;
+    }
+
+    if (!is_valid_literal_terminator(lexer_peek(p, end)))
+        return NULL;
+
+    if (!decode) {
+        *type = MJ_NUMBER_LAZY;
+        return p;
+    }
+
+    /* Integers are kept exact, without going through a double, as long as
+     * they fit in 64 bits. w holds up to 19 digits, a 20th may still fit. */
+    if (p == integer_end) {
+        if (exponent == 1 && w <= (UINT64_MAX - (p[-1] - '0')) / 10) {
+            w = w * 10 + (p[-1] - '0');
+            exponent = 0;
+        }
+        if (exponent == 0 && !negative) {
+            *type = w <= INT64_MAX ? MJ_NUMBER_INT64 : MJ_NUMBER_UINT64;
+            number->uint64 = w;
+            return p;
+        }
+        /* -0 stays a double to keep its sign */
+        if (exponent == 0 && w != 0 && w - 1 <= INT64_MAX) {
+            *type = MJ_NUMBER_INT64;
+            number->int64 = -(int64_t)(w - 1) - 1;
+            return p;
         }
-        ++curr;
-        ++len;
     }
-    /* Accept states */
-    if (!(state == Q2_INITIAL_ZERO || state == Q3_DIGIT ||
-          state == Q5_FRAC_DIGIT || state == Q8_EXP_DIGIT))
+
+    q = exponent + (exponent_negative ? -explicit_exponent : explicit_exponent);
+
+    if (!truncated && q == 0) {
+        /* Integers, the conversion rounds correctly */
+        value = (double)w;
+        if (negative)
+            value = -value;
+#ifdef NUMBER_HAVE_CLINGER
+    } else if (!truncated && w <= (uint64_t)1 << 53 && q >= -22 && q <= 22) {
+        /* Clinger, both operands are exact so the one rounding is correct */
+        value = (double)w;
+        if (q < 0)
+            value /= number_exact_pow10[-q];
+        else
+            value *= number_exact_pow10[q];
+        if (negative)
+            value = -value;
+#endif
+    } else if (number_eisel_lemire(w, q, negative, &value) == -1 ||
+               (truncated &&
+                (number_eisel_lemire(w + 1, q, negative, &other) == -1 ||
+                 memcmp(&value, &other, sizeof(value)) != 0))) {
+        /* The dropped digits put it somewhere between w and w + 1 */
+        value = number_fallback(start,
+                                end,
+                                exponent_negative ? -explicit_exponent : explicit_exponent);
+    }
+
+    *type = MJ_NUMBER_DOUBLE;
+    number->real = value;
+
+    return p;
+}
+
+/* Validates the number at lexer and, unless numbers are lazy, decodes it in
+ * token->number */
+static int lexer_add_number(struct minjson_lexer *lexer,
+                            struct minjson_token *token)
+{
+    const char *number_end = number_parse(lexer->current,
+                                          lexer->end,
+                                          !lexer->lazy_numbers,
+                                          &token->number_type,
+                                          &token->number);
+    size_t len;
+
+    if (!number_end)
         return -1;
 
-    lexer_add_token(TK_NUMBER, lexer, len);
+    len = number_end - lexer->current;
+    lexer_set_token(TK_NUMBER, lexer, len, token);
     lexer_advance(lexer, len - 1); /* So this doesn't go pass the delimiter */
 
     return 0;
@@ -310,9 +883,10 @@ static int lexer_add_number(struct minjson_lexer *lexer)
 /* I'm not sure what to call these (true, false, null)
  * identifier? keyword? reserved word? literal? whatever...*/
 static int lexer_match_literal(struct minjson_lexer *lexer,
-                                  enum token_type type,
-                                  const char *literal,
-                                  size_t len)
+                               enum token_type type,
+                               const char *literal,
+                               size_t len,
+                               struct minjson_token *token)
 {
     /* No way to sanity check the type and the matched literal
      * Just dont use this for stupid thing, I guess.*/
@@ -320,35 +894,78 @@ static int lexer_match_literal(struct minjson_lexer *lexer,
 
     ASSERT(strlen(literal) == len);
 
-    if (strncmp(lexer->current, literal, len) != 0)
+    if ((size_t)(lexer->end - lexer->current) < len ||
+        memcmp(lexer->current, literal, len) != 0)
         return -1;
 
     /* This is for catching lexer error early on, for cases like
      * truenull, truefalse, and the like*/
-    char_after_literal = lexer->current[len];
+    char_after_literal = lexer_peek(lexer->current + len, lexer->end);
     if (!is_valid_literal_terminator(char_after_literal))
         return -1;
 
-    lexer_add_token(type, lexer, len);
+    lexer_set_token(type, lexer, len, token);
     lexer_advance(lexer, len - 1);
 
     return 0;
 }
 
-static int minjson_object_is_key_exist(struct minjson_object *object,
-                                       const char *key)
+/* FNV-1a */
+static uint32_t minjson_hash_key(const char *key, size_t len)
 {
-    struct minjson_object_entry *entry;
+    uint32_t hash = 2166136261u;
+    size_t i;
 
-    ASSERT(object && key);
- 
-    entry = object->head;
-    for (; entry; entry = entry->next)
-        if (strcmp(key, entry->key) == 0)
-            return 1;
+    for (i = 0; i < len; ++i) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
 
-    return 0;
+    return hash;
+}
 
+static int minjson_key_equal(const char *key,
+                             size_t len,
+                             const struct minjson_object_entry *entry)
+{
+    return len == entry->key_len && memcmp(key, entry->key, len) == 0;
+}
+
+/* Index stays at most half full so probe sequences are short */
+static int minjson_object_build_index(struct minjson_object *object,
+                                      struct arena_allocator *aa)
+{
+    size_t capacity = 1;
+    size_t slot;
+    size_t i;
+    uint32_t hash;
+
+    if (object->len >= UINT32_MAX / 2)
+        return 0;
+
+    while (capacity < 2 * object->len)
+        capacity *= 2;
+
+    object->index = arena_allocator_alloc(aa,
+                                          DEFAULT_ALIGNMENT,
+                                          capacity * sizeof(struct minjson_object_slot));
+    if (!object->index)
+        return -1;
+
+    memset(object->index, 0, capacity * sizeof(struct minjson_object_slot));
+    object->index_mask = capacity - 1;
+
+    for (i = 0; i < object->len; ++i) {
+        hash = minjson_hash_key(object->entries[i].key, object->entries[i].key_len);
+        slot = hash & object->index_mask;
+        while (object->index[slot].entry)
+            slot = (slot + 1) & object->index_mask;
+
+        object->index[slot].hash = hash;
+        object->index[slot].entry = (uint32_t)(i + 1);
+    }
+
+    return 0;
 }
 
 static void codepoint_to_utf8(unsigned long codepoint, 
@@ -376,15 +993,35 @@ static void codepoint_to_utf8(unsigned long codepoint,
     }
 }
 
-static char *minjson_string_decode_escape_sequence(struct minjson_token *token,
-                                                   struct arena_allocator *aa,
-                                                   struct minjson_error *error)
+/* Null terminated copy of a string without escape sequences */
+static char *minjson_string_copy(struct minjson_token *token,
+                                 struct arena_allocator *aa,
+                                 struct minjson_error *error)
+{
+    char *res = arena_allocator_alloc(aa, DEFAULT_ALIGNMENT, token->len + 1);
+
+    if (!res) {
+        minjson_error_set_allocator(error, aa);
+        return NULL;
+    }
+
+    memcpy(res, token->lexeme, token->len);
+    res[token->len] = '\0';
+
+    return res;
+}
+
+/* Decodes the escape sequences of the string in token into out, its length
+ * goes in out_len. out may be the lexeme itself, no escape sequence decodes
+ * to more bytes than it takes so nothing is written ahead of what is read. */
+static int minjson_string_unescape(struct minjson_token *token,
+                                   char *out,
+                                   size_t *out_len,
+                                   struct minjson_error *error)
 {
     const char *lexeme = token->lexeme;
     const size_t len = token->len;
 
-    char *res = NULL;
-    char tmp[len];
     char replace;
 
     char unicode_buff[5];
@@ -402,7 +1039,7 @@ static char *minjson_string_decode_escape_sequence(struct minjson_token *token,
 
     while (i < len) {
         if (lexeme[i] == '\\') {
-            memcpy(tmp + new_len, lexeme + j, i - j);
+            memmove(out + new_len, lexeme + j, i - j);
             new_len += i - j;
 
             j = i + 1;
@@ -477,7 +1114,7 @@ static char *minjson_string_decode_escape_sequence(struct minjson_token *token,
                     ASSERT(sizeof(utf8) == 4);
                     codepoint_to_utf8(codepoint, utf8, &utf8_nbytes);
 
-                    memcpy(tmp + new_len, utf8, utf8_nbytes);
+                    memcpy(out + new_len, utf8, utf8_nbytes);
                     new_len += utf8_nbytes;
 
                     goto pass_replace;
@@ -486,7 +1123,7 @@ static char *minjson_string_decode_escape_sequence(struct minjson_token *token,
                 default:
                     goto fail_invalid_escape_sequence;
             }
-            tmp[new_len] = replace;
+            out[new_len] = replace;
             ++new_len;
 
             /* UTF-8 is up to 4 bytes so above logic must be passed */
@@ -499,21 +1136,11 @@ static char *minjson_string_decode_escape_sequence(struct minjson_token *token,
         }
     }
 
-    memcpy(tmp + new_len, lexeme + j, i - j);
+    memmove(out + new_len, lexeme + j, i - j);
     new_len += i - j;
+    *out_len = new_len;
 
-    res = arena_allocator_alloc(aa, DEFAULT_ALIGNMENT, new_len + 1);
-    if (!res)
-        goto fail_allocator;
-
-    memcpy(res, tmp, new_len);
-    res[new_len] = '\0';
-
-    return res;
-
-fail_allocator:
-    minjson_error_set(error, MJ_ERR_ALLOCATOR, "memory allocator failed", 0, 0);
-    return NULL;
+    return 0;
 
 fail_invalid_escape_sequence:
     minjson_error_set(error,
@@ -521,7 +1148,7 @@ fail_invalid_escape_sequence:
                       "invalid string escape sequence at line %zu, column %zu",
                       token->line,
                       token->column);
-    return NULL;
+    return -1;
 
 fail_ls:
     minjson_error_set(error,
@@ -529,83 +1156,143 @@ fail_ls:
                       "unicode escape sequence missing or invalid low surrogate at line %zu, column %zu",
                       token->line,
                       token->column);
-    return NULL;
+    return -1;
 }
 
-int minjson_lexer_tokenize(struct minjson_lexer *lexer,
-                           struct minjson_error *error)
+/* Null terminated copy of the string in token with its escape sequences
+ * decoded, its length without the nul goes in out_len. Decoded straight in
+ * the arena, sized from the lexeme as decoding never makes it longer. The
+ * few bytes escapes save are left unused. */
+static char *minjson_string_decode_escape_sequence(struct minjson_token *token,
+                                                   struct arena_allocator *aa,
+                                                   size_t *out_len,
+                                                   struct minjson_error *error)
 {
-    while (*lexer->current != '\0') {
-        switch (*lexer->current) {
-            case '{':
-                lexer_add_token(TK_OPEN_CB, lexer, 1);
-                break;
-            case '}':
-                lexer_add_token(TK_CLOSE_CB, lexer, 1);
-                break;
-            case '[':
-                lexer_add_token(TK_OPEN_SB, lexer, 1);
-                break;
-            case ']':
-                lexer_add_token(TK_CLOSE_SB, lexer, 1);
-                break;
-            case ':':
-                lexer_add_token(TK_COLON, lexer, 1);
-                break;
-            case ',':
-                lexer_add_token(TK_DELIMITER, lexer, 1);
-                break;
-            case '"':
-                if (lexer_add_string(lexer) == -1)
-                    goto fail_string;
-                break;
-            case 't':
-                if (lexer_match_literal(lexer, TK_TRUE, "true", 4) == -1)
-                    goto fail_literal;
-                break;
-            case 'f':
-                if (lexer_match_literal(lexer, TK_FALSE, "false", 5) == -1)
-                    goto fail_literal;
-                break;
-            case 'n':
-                if (lexer_match_literal(lexer, TK_NULL, "null", 4) == -1)
-                    goto fail_literal;
-                break;
-            case '0': case '1': case '2': case '3': case '4': case '5':
-            case '6': case '7': case '8': case '9': case '-':
-                if (lexer_add_number(lexer) == -1)
-                    goto fail_number;
-                break;
-            case ' ': case '\t': case '\n': case '\r':
-                lexer_skip_whitespaces(lexer);
-                /* Skips advance logic below,
-                 * lexer now points to non-whitespace after function above */
-                continue;
-            default:
-                goto fail_token;
-        }
-        lexer_advance(lexer, 1);
+    char *res = arena_allocator_alloc(aa, DEFAULT_ALIGNMENT, token->len + 1);
+
+    if (!res) {
+        minjson_error_set_allocator(error, aa);
+        return NULL;
     }
 
-    return 0;
+    if (minjson_string_unescape(token, res, out_len, error) == -1)
+        return NULL;
+    res[*out_len] = '\0';
 
-fail_string:
-    minjson_error_set(error,
-                      MJ_ERR_STRING,
-                      "unterminated string at line %zu, column %zu",
-                      lexer->pos_line,
-                      lexer->pos_column);
-    return -1;
+    return res;
+}
 
-fail_literal:
-    minjson_error_set(error,
-                      MJ_ERR_LITERAL,
-                      "unexpected literal at line %zu, column %zu",
-                      lexer->pos_line,
-                      lexer->pos_column);
-    return -1;
+/* True if the literal or number at current may go on past end */
+static int lexer_scalar_cut(const struct minjson_lexer *lexer)
+{
+    const char *p = lexer->current;
 
-fail_number:
+    while (p < lexer->end && is_scalar_byte(*p))
+        ++p;
+
+    return p == lexer->end;
+}
+
+/* Scans exactly one token, returns 1 if token is filled, 0 on end of input
+ * and -1 on error. When partial, a token cut by end returns 2 with lexer
+ * left at its first byte. */
+static int lexer_next_token(struct minjson_lexer *lexer,
+                            struct minjson_token *token,
+                            struct minjson_error *error)
+{
+    lexer_skip_whitespaces(lexer);
+
+    /* A nul before end is not the end, it falls to fail_token */
+    if (lexer->current == lexer->end)
+        return 0;
+
+    if (lexer->partial && lexer_scalar_cut(lexer))
+        return 2;
+
+    switch (*lexer->current) {
+        case '{':
+            lexer_set_token(TK_OPEN_CB, lexer, 1, token);
+            break;
+        case '}':
+            lexer_set_token(TK_CLOSE_CB, lexer, 1, token);
+            break;
+        case '[':
+            lexer_set_token(TK_OPEN_SB, lexer, 1, token);
+            break;
+        case ']':
+            lexer_set_token(TK_CLOSE_SB, lexer, 1, token);
+            break;
+        case ':':
+            lexer_set_token(TK_COLON, lexer, 1, token);
+            break;
+        case ',':
+            lexer_set_token(TK_DELIMITER, lexer, 1, token);
+            break;
+        case '"':
+            switch (lexer_add_string(lexer, token)) {
+                case -3:
+                    if (lexer->partial) {
+                        /* Back on the opening ", never a line feed */
+                        lexer->current -= 1;
+                        lexer->pos_column -= 1;
+                        return 2;
+                    }
+                    goto fail_string;
+                case -1:
+                    goto fail_string;
+                case -2:
+                    goto fail_control;
+            }
+            break;
+        case 't':
+            if (lexer_match_literal(lexer, TK_TRUE, "true", 4, token) == -1)
+                goto fail_literal;
+            break;
+        case 'f':
+            if (lexer_match_literal(lexer, TK_FALSE, "false", 5, token) == -1)
+                goto fail_literal;
+            break;
+        case 'n':
+            if (lexer_match_literal(lexer, TK_NULL, "null", 4, token) == -1)
+                goto fail_literal;
+            break;
+        case '0': case '1': case '2': case '3': case '4': case '5':
+        case '6': case '7': case '8': case '9': case '-':
+            if (lexer_add_number(lexer, token) == -1)
+                goto fail_number;
+            break;
+        default:
+            goto fail_token;
+    }
+    lexer_advance(lexer, 1);
+
+    return 1;
+
+fail_string:
+    minjson_error_set(error,
+                      MJ_ERR_STRING,
+                      "unterminated string at line %zu, column %zu",
+                      lexer->pos_line,
+                      lexer->pos_column);
+    return -1;
+
+fail_control:
+    minjson_error_set(error,
+                      MJ_ERR_STRING,
+                      "control character in string at line %zu, column %zu",
+                      lexer->pos_line,
+                      lexer->pos_column);
+    return -1;
+
+fail_literal:
+    minjson_error_set(error,
+                      MJ_ERR_LITERAL,
+                      "unexpected literal at line %zu, column %zu",
+                      lexer->pos_line,
+                      lexer->pos_column);
+    return -1;
+
+fail_number:
     minjson_error_set(error,
                       MJ_ERR_NUMBER,
                       "invalid number sequence at line %zu, column %zu",
@@ -622,6 +1309,22 @@ fail_token:
     return -1;
 }
 
+int minjson_lexer_tokenize(struct minjson_lexer *lexer,
+                           struct minjson_error *error)
+{
+    struct minjson_token token;
+    int status;
+
+    while ((status = lexer_next_token(lexer, &token, error)) == 1) {
+        if (lexer_add_token(lexer, &token) == -1) {
+            minjson_error_set_allocator(error, lexer->aallocator);
+            return -1;
+        }
+    }
+
+    return status;
+}
+
 void minjson_lexer_print_tokens(struct minjson_lexer *lexer)
 {
     char *type_name = "";
@@ -647,8 +1350,10 @@ void minjson_lexer_print_tokens(struct minjson_lexer *lexer)
     }
 }
 
-struct minjson_lexer *minjson_lexer_new(struct arena_allocator *aa,
-                                        const char *raw_json)
+/* minjson_lexer_new for a raw_json whose length is already known */
+static struct minjson_lexer *lexer_new(struct arena_allocator *aa,
+                                       const char *raw_json,
+                                       size_t input_len)
 {
     struct minjson_lexer *lexer = NULL;
     /* If aa belongs to caller, dont free on error */
@@ -669,15 +1374,24 @@ struct minjson_lexer *minjson_lexer_new(struct arena_allocator *aa,
     if (lexer) {
         lexer->aallocator = aa;
         lexer->current = raw_json;
+        lexer->end = raw_json + input_len;
         lexer->pos_line = 1;
         lexer->pos_column = 1;
         lexer->tk_head = NULL;
         lexer->tk_tail = NULL;
+        lexer->lazy_numbers = 0;
+        lexer->partial = 0;
     }
 
     return lexer;
 }
 
+struct minjson_lexer *minjson_lexer_new(struct arena_allocator *aa,
+                                        const char *raw_json)
+{
+    return lexer_new(aa, raw_json, strlen(raw_json));
+}
+
 struct minjson *minjson_new(struct arena_allocator *aa)
 {
     struct minjson *doc = NULL;
@@ -697,6 +1411,7 @@ struct minjson *minjson_new(struct arena_allocator *aa)
     if (doc) {
         doc->root = NULL;
         doc->aallocator = aa;
+        doc->footprint = 0;
     }
 
     return doc;
@@ -713,454 +1428,1775 @@ struct minjson_error minjson_error_new(void)
     return error;
 }
 
-struct minjson_value *minjson_parse_value(struct minjson_token **token,
-                                          struct arena_allocator *aa,
-                                          struct minjson_error *error);
+struct minjson_parse_options minjson_parse_options_new(void)
+{
+    struct minjson_parse_options options;
+    options.doc_arena_size = 0;
+    options.scratch_arena_size = 0;
+    options.scratch_aa = NULL;
+    options.backend = NULL;
+    options.backend_user = NULL;
+    options.object_index_threshold = 0;
+    options.duplicate_keys = MJ_DUPLICATE_REJECT;
+    options.lazy_numbers = 0;
+    options.zero_copy_strings = 0;
+
+    return options;
+}
 
-int minjson_object_create_entry(struct minjson_object *object,
-                                struct arena_allocator *aa,
-                                char *key,
-                                struct minjson_value *value)
+/* A DOM whose strings are copied takes about 2.5 times a string heavy input
+ * and up to 6 times one made of small values. Undershooting only costs a few
+ * more arenas as they grow geometrically. */
+#define DOC_ARENA_SIZE_FACTOR 2
+
+/* Without copies_strings (insitu or zero_copy_strings) the input length is
+ * used as is. A derived size never goes above the largest chunk the arena
+ * grows to by itself. */
+static size_t minjson_doc_arena_size(const struct minjson_parse_options *options,
+                                     size_t input_len,
+                                     int copies_strings)
 {
-    struct minjson_object_entry *entry = \
-        arena_allocator_alloc(aa,
-                              DEFAULT_ALIGNMENT,
-                              sizeof(struct minjson_object_entry));
-    if (!entry)
-        return -1;
+    size_t size = options->doc_arena_size;
 
-    entry->key = key;
-    entry->value = value;
-    entry->next = NULL;
-    if (object->tail)
-        object->tail->next = entry;
-    else
-        object->head = entry;
-    object->tail = entry;
-    ++object->len;
+    if (size == 0) {
+        if (copies_strings && input_len <= DEFAULT_ARENA_MAX_CHUNK_SIZE / DOC_ARENA_SIZE_FACTOR)
+            size = input_len * DOC_ARENA_SIZE_FACTOR;
+        else
+            size = input_len;
+        if (size > DEFAULT_ARENA_MAX_CHUNK_SIZE)
+            size = DEFAULT_ARENA_MAX_CHUNK_SIZE;
+    }
 
-    return 0;
+    return size < DEFAULT_ARENA_SIZE ? DEFAULT_ARENA_SIZE : size;
 }
 
-struct minjson_object *minjson_parse_object(struct minjson_token **token,
-                                            struct arena_allocator *aa,
-                                            struct minjson_error *error)
+/* Scratch only holds the lexer and one frame per nesting level, which the
+ * input length says little about */
+static size_t minjson_scratch_arena_size(const struct minjson_parse_options *options)
 {
-    struct minjson_token *current = *token;
-    struct minjson_token *lookahead = current->next;
-    struct minjson_object *object = \
-        arena_allocator_alloc(aa,
-                              DEFAULT_ALIGNMENT,
-                              sizeof(struct minjson_object));
-    if (!object)
-        goto fail_allocator;
-    object->head = NULL;
-    object->tail =  NULL;
-    object->len = 0;
-
-    if (!lookahead) {
-        goto fail_expected_closing_brace;
-    } else if (lookahead && lookahead->type == TK_CLOSE_CB) {
-        current = lookahead;
-        *token = current;
-        return object;
-    }
-
-    /* string -> colon -> value, if delimiter repeat cycle, else expect '}' */
-    while (lookahead) {
-        char *key;
-        struct minjson_value *value;
-
-        /* Key */
-        if (!lookahead || lookahead->type != TK_STRING)
-            goto fail_expected_string;
-        current = lookahead;
-        key = minjson_string_decode_escape_sequence(current, aa, error);
-        if (!key)
-            return NULL;
+    size_t size = options->scratch_arena_size;
 
-        if (minjson_object_is_key_exist(object, key))
-            goto fail_duplicate_key;
-
-        /* Colon */
-        lookahead = current->next;
-        if (!lookahead || lookahead->type != TK_COLON)
-            goto fail_expected_colon;
-        current = lookahead;
-
-        /* Value */
-        lookahead = current->next;
-        if (!lookahead)
-            goto fail_expected_value;
-        current = lookahead;
+    return size < DEFAULT_ARENA_SIZE ? DEFAULT_ARENA_SIZE : size;
+}
 
-        /* After call to parse value current hold the last token of value */
-        value = minjson_parse_value(&current, aa, error);
-        if (!value)
-            return NULL;
+static size_t minjson_object_index_threshold(const struct minjson_parse_options *options)
+{
+    size_t threshold = options->object_index_threshold;
 
-        if (minjson_object_create_entry(object, aa, key, value) == -1)
-            goto fail_allocator;
+    return threshold ? threshold : MINJSON_OBJECT_INDEX_THRESHOLD;
+}
 
-        lookahead = current->next;
+/* Scratch that belongs to the caller goes back to how it was before parsing */
+static void minjson_scratch_release(struct arena_allocator *scratch_aa,
+                                    unsigned char free_scratch_aa,
+                                    struct arena_mark scratch_mark)
+{
+    if (free_scratch_aa)
+        arena_allocator_destroy(scratch_aa);
+    else
+        arena_allocator_rollback_to(scratch_aa, scratch_mark);
+}
 
-        /* Delimiter */
-        if (!lookahead || lookahead->type != TK_DELIMITER)
-            break;
-        current = lookahead;
-        lookahead = current->next;
-    }
+enum parser_state {
+    PS_VALUE,           /* Expects any value */
+    PS_OBJECT_FIRST,    /* After '{', expects key or '}' */
+    PS_OBJECT_KEY,      /* After ',' inside object, expects key */
+    PS_OBJECT_COLON,    /* After key, expects ':' */
+    PS_OBJECT_NEXT,     /* After value inside object, expects ',' or '}' */
+    PS_ARRAY_FIRST,     /* After '[', expects value or ']' */
+    PS_ARRAY_NEXT,      /* After value inside array, expects ',' or ']' */
+    PS_DONE             /* Root value is complete, expects end of input */
+};
 
-    if (!lookahead || lookahead->type != TK_CLOSE_CB)
-        goto fail_expected_closing_brace;
+/* An object or array whose closing token has not been seen yet */
+struct minjson_parser_frame {
+    enum minjson_type type;             /* MJ_OBJECT or MJ_ARRAY */
+    struct minjson_value *container;    /* NULL on a tape */
+    const char *key;    /* Key still waiting for its value, object only */
+    size_t key_len;
+    size_t base; /* Where its entries or elements start on their stack */
+    /* Object only. Position of the entry key duplicates, relative to base,
+     * and the set of keys seen so far once there are too many to scan. */
+    size_t duplicate;
+    struct minjson_object_slot *set;
+    size_t set_mask;
+    /* Tape only, where its open word is and how many entries or elements
+     * it has so far */
+    size_t open;
+    size_t count;
+};
 
-    current = lookahead;
-    *token = current;
+/* The parser is fed one token at a time by parser_accept, so the lexer never
+ * has to build the whole token stream. Most syntax errors are reported at the
+ * last accepted token, hence prev_line and prev_column. */
+struct minjson_parser {
+    struct arena_allocator *aallocator; /* Where the DOM lives */
+    struct arena_allocator *scratch;    /* Where the frames and value stack live */
+    struct minjson_parser_frame *frames;
+    size_t depth;
+    size_t capacity;
+    /* Elements of every open array, innermost last. An array gets its own
+     * contiguous copy in aallocator once it is closed. */
+    struct minjson_value **values;
+    size_t values_len;
+    size_t values_capacity;
+    /* Same for the entries of every open object */
+    struct minjson_object_entry *entries;
+    size_t entries_len;
+    size_t entries_capacity;
+    size_t index_threshold;
+    enum minjson_duplicate_policy duplicate_policy;
+    int zero_copy_strings; /* Strings without escapes point in the input */
+    int insitu; /* Strings are decoded and null terminated in the input */
+    /* Key set of the last big object closed, reused by the next one */
+    struct minjson_object_slot *spare_set;
+    size_t spare_mask;
+    /* Tape being built instead of the DOM, NULL for a DOM. Strings can't
+     * outgrow the input, so the string buffer is sized once and never moves. */
+    uint64_t *tape;
+    size_t tape_len;
+    size_t tape_capacity;
+    char *strings;
+    size_t strings_len;
+    enum parser_state state;
+    struct minjson_value *root;
+    size_t prev_line, prev_column;
+};
 
-    return object;
+/* Stacks are allocated on their first push and doubled from there, a small
+ * document leaves little scratch behind and fits a small static arena */
+#define PARSER_INITIAL_DEPTH 4
+#define PARSER_INITIAL_VALUES 8
+#define PARSER_INITIAL_ENTRIES 8
+#define PARSER_INITIAL_TAPE 16
+#define PARSER_DUPLICATE_SCAN_MAX 8
+#define PARSER_NO_DUPLICATE ((size_t)-1)
+
+static void parser_init(struct minjson_parser *parser,
+                        struct arena_allocator *aa,
+                        struct arena_allocator *scratch,
+                        size_t index_threshold,
+                        enum minjson_duplicate_policy duplicate_policy)
+{
+    parser->aallocator = aa;
+    parser->scratch = scratch;
+    parser->frames = NULL;
+    parser->depth = 0;
+    parser->capacity = 0;
+    parser->values = NULL;
+    parser->values_len = 0;
+    parser->values_capacity = 0;
+    parser->entries = NULL;
+    parser->entries_len = 0;
+    parser->entries_capacity = 0;
+    parser->index_threshold = index_threshold;
+    parser->duplicate_policy = duplicate_policy;
+    parser->zero_copy_strings = 0;
+    parser->insitu = 0;
+    parser->spare_set = NULL;
+    parser->spare_mask = 0;
+    parser->tape = NULL;
+    parser->tape_len = 0;
+    parser->tape_capacity = 0;
+    parser->strings = NULL;
+    parser->strings_len = 0;
+    parser->state = PS_VALUE;
+    parser->root = NULL;
+    parser->prev_line = 1;
+    parser->prev_column = 1;
+}
 
-fail_allocator: 
-    minjson_error_set(error, MJ_ERR_ALLOCATOR, "memory allocator failed", 0, 0);
-    return NULL;
+static int parser_push_frame(struct minjson_parser *parser,
+                             enum minjson_type type,
+                             struct minjson_value *container)
+{
+    struct minjson_parser_frame *frame;
+    size_t capacity;
+
+    if (parser->depth == parser->capacity) {
+        capacity = parser->capacity ? 2 * parser->capacity : PARSER_INITIAL_DEPTH;
+        frame = arena_allocator_alloc(parser->scratch,
+                                      DEFAULT_ALIGNMENT,
+                                      capacity * sizeof(*frame));
+        if (!frame)
+            return -1;
 
-fail_duplicate_key:
-    minjson_error_set(error,
-                      MJ_ERR_OBJECT,
-                      "found duplicate key at line %zu, column %zu",
-                      current->line, current->column);
-    return NULL;
+        if (parser->depth)
+            memcpy(frame, parser->frames, parser->depth * sizeof(*frame));
+        parser->frames = frame;
+        parser->capacity = capacity;
+    }
 
-fail_expected_string:
-    minjson_error_set(error,
-                      MJ_ERR_OBJECT,
-                      "syntax error, expected string at line %zu, column %zu",
-                      current->line, current->column);
-    return NULL;
+    frame = &parser->frames[parser->depth++];
+    frame->type = type;
+    frame->container = container;
+    frame->key = NULL;
+    frame->key_len = 0;
+    frame->base = type == MJ_OBJECT ? parser->entries_len : parser->values_len;
+    frame->duplicate = PARSER_NO_DUPLICATE;
+    frame->set = NULL;
+    frame->set_mask = 0;
+    frame->open = parser->tape_len;
+    frame->count = 0;
 
-fail_expected_colon:
-    minjson_error_set(error,
-                      MJ_ERR_OBJECT,
-                      "syntax error, expected ':' at line %zu, column %zu",
-                      current->line, current->column);
-    return NULL;
+    return 0;
+}
 
-fail_expected_value:
-    minjson_error_set(error,
-                      MJ_ERR_OBJECT,
-                      "syntax error, expected value at line %zu, column %zu",
-                      current->line, current->column);
-    return NULL;
+static int parser_push_value(struct minjson_parser *parser,
+                             struct minjson_value *value)
+{
+    struct minjson_value **values;
+    size_t capacity;
+
+    if (parser->values_len == parser->values_capacity) {
+        capacity = parser->values_capacity ? 2 * parser->values_capacity
+                                           : PARSER_INITIAL_VALUES;
+        values = arena_allocator_alloc(parser->scratch,
+                                       DEFAULT_ALIGNMENT,
+                                       capacity * sizeof(*values));
+        if (!values)
+            return -1;
 
-fail_expected_closing_brace:
-    if (!current) {
-        minjson_error_set(error,
-                          MJ_ERR_OBJECT,
-                          "syntax error, unexpected EOF",
-                          0, 0);
-    } else {
-        minjson_error_set(error,
-                          MJ_ERR_OBJECT,
-                          "syntax error, expected '}' at end of object, line %zu, column %zu",
-                          current->line, current->column);
+        if (parser->values_len)
+            memcpy(values, parser->values, parser->values_len * sizeof(*values));
+        parser->values = values;
+        parser->values_capacity = capacity;
     }
-    return NULL;
-}
 
-int minjson_array_create_entry(struct minjson_array* array,
-                               struct arena_allocator* aa,
-                               struct minjson_value *value)
-{
-    struct minjson_array_entry *entry = \
-        arena_allocator_alloc(aa,
-                              DEFAULT_ALIGNMENT,
-                              sizeof(struct minjson_array_entry));
-    if(!entry)
-        return -1;
-    entry->value = value;
-    entry->next = NULL;
-    if (array->tail)
-        array->tail->next = entry;
-    else
-        array->head = entry;
-    array->tail = entry;
-    ++array->len;
+    parser->values[parser->values_len++] = value;
 
     return 0;
 }
- 
-struct minjson_array *minjson_parse_array(struct minjson_token **token,
-                                          struct arena_allocator *aa,
-                                          struct minjson_error *error)
+
+static int parser_push_entry(struct minjson_parser *parser,
+                             const char *key,
+                             size_t key_len,
+                             struct minjson_value *value)
 {
-    struct minjson_token *current = *token;
-    struct minjson_token *lookahead = current->next;
-    struct minjson_array *array = \
-        arena_allocator_alloc(aa,
-                              DEFAULT_ALIGNMENT,
-                              sizeof(struct minjson_array));
-    if (!array)
-        goto fail_allocator;
-    array->head = NULL;
-    array->tail = NULL;
-    array->len = 0;
+    struct minjson_object_entry *entries;
+    size_t capacity;
+
+    if (parser->entries_len == parser->entries_capacity) {
+        capacity = parser->entries_capacity ? 2 * parser->entries_capacity
+                                            : PARSER_INITIAL_ENTRIES;
+        entries = arena_allocator_alloc(parser->scratch,
+                                        DEFAULT_ALIGNMENT,
+                                        capacity * sizeof(*entries));
+        if (!entries)
+            return -1;
 
-    if (!lookahead) {
-        goto fail_expected_closing_bracket;
-    } else if (lookahead && lookahead->type == TK_CLOSE_SB) {
-        current = lookahead;
-        *token = current;
-        return array;
+        if (parser->entries_len)
+            memcpy(entries, parser->entries, parser->entries_len * sizeof(*entries));
+        parser->entries = entries;
+        parser->entries_capacity = capacity;
     }
 
-    while (lookahead) {
-        struct minjson_value *value;
-
-        /* Value */
-        if (!lookahead)
-            goto fail_expected_value;
-        current = lookahead;
-
-        /* After call to parse value current hold the last token of value */
-        value = minjson_parse_value(&current, aa, error);
-        if (!value)
-            return NULL;
-        lookahead = current->next;
+    parser->entries[parser->entries_len].key = key;
+    parser->entries[parser->entries_len].key_len = key_len;
+    parser->entries[parser->entries_len].value = value;
+    ++parser->entries_len;
 
-        if (minjson_array_create_entry(array, aa, value) == -1)
-            goto fail_allocator;
+    return 0;
+}
 
-        /* Delimiter */
-        if (!lookahead || lookahead->type != TK_DELIMITER)
-            break;
-        current = lookahead;
-        lookahead = current->next;
+/* Keeps the bigger of set and the current spare for the next big object */
+static void parser_release_key_set(struct minjson_parser *parser,
+                                   struct minjson_object_slot *set,
+                                   size_t mask)
+{
+    if (set && (!parser->spare_set || mask > parser->spare_mask)) {
+        parser->spare_set = set;
+        parser->spare_mask = mask;
     }
+}
 
-    if (!lookahead || lookahead->type != TK_CLOSE_SB)
-        goto fail_expected_closing_bracket;
+static void parser_key_set_insert(struct minjson_object_slot *set,
+                                  size_t mask,
+                                  uint32_t hash,
+                                  uint32_t entry)
+{
+    size_t slot;
 
-    current = lookahead;
-    *token = current;
+    for (slot = hash & mask; set[slot].entry; slot = (slot + 1) & mask)
+        ;
+    set[slot].hash = hash;
+    set[slot].entry = entry;
+}
 
-    return array;
+/* Gives frame a key set at most a quarter full with its len pending entries
+ * and the key about to be added */
+static int parser_key_set_resize(struct minjson_parser *parser,
+                                 struct minjson_parser_frame *frame,
+                                 size_t len)
+{
+    struct minjson_object_slot *set;
+    size_t capacity = 1;
+    size_t mask;
+    size_t i;
 
-fail_allocator: 
-    minjson_error_set(error, MJ_ERR_ALLOCATOR, "memory allocator failed", 0, 0);
-    return NULL;
+    while (capacity < 4 * (len + 1))
+        capacity *= 2;
 
-fail_expected_value:
-    minjson_error_set(error,
-                      MJ_ERR_OBJECT,
-                      "syntax error, expected value at line %zu, column %zu",
-                      current->line, current->column);
-    return NULL;
+    if (parser->spare_set && parser->spare_mask >= capacity - 1) {
+        set = parser->spare_set;
+        mask = parser->spare_mask;
+        parser->spare_set = NULL;
+    } else {
+        set = arena_allocator_alloc(parser->scratch,
+                                    DEFAULT_ALIGNMENT,
+                                    capacity * sizeof(struct minjson_object_slot));
+        if (!set)
+            return -1;
+        mask = capacity - 1;
+    }
+    memset(set, 0, (mask + 1) * sizeof(struct minjson_object_slot));
 
-fail_expected_closing_bracket:
-    if (!current) {
-        minjson_error_set(error,
-                          MJ_ERR_OBJECT,
-                          "syntax error, unexpected EOF",
-                          0, 0);
+    /* Hashes are kept in the old set, only computed when there is none */
+    if (frame->set) {
+        for (i = 0; i <= frame->set_mask; ++i)
+            if (frame->set[i].entry)
+                parser_key_set_insert(set, mask, frame->set[i].hash, frame->set[i].entry);
     } else {
-        minjson_error_set(error,
-                          MJ_ERR_OBJECT,
-                          "syntax error, expected ']' at end of array, line %zu, column %zu",
-                          current->line, current->column);
+        for (i = 0; i < len; ++i)
+            parser_key_set_insert(set,
+                                  mask,
+                                  minjson_hash_key(parser->entries[frame->base + i].key,
+                                                   parser->entries[frame->base + i].key_len),
+                                  (uint32_t)(i + 1));
     }
-    return NULL;
+
+    parser_release_key_set(parser, frame->set, frame->set_mask);
+    frame->set = set;
+    frame->set_mask = mask;
+
+    return 0;
 }
 
-struct minjson_value *minjson_parse_value(struct minjson_token **token,
-                                          struct arena_allocator *aa,
-                                          struct minjson_error *error)
+/**
+ * Looks key up among the pending entries of the object in frame. position
+ * is where it was found relative to frame base, PARSER_NO_DUPLICATE if it
+ * wasn't. Small objects are scanned, bigger ones get a key set in scratch
+ * that key is added to when absent.
+ */
+static int parser_find_key(struct minjson_parser *parser,
+                           struct minjson_parser_frame *frame,
+                           const char *key,
+                           size_t key_len,
+                           size_t *position)
 {
-    struct minjson_value *val = NULL;
-    struct minjson_token *current = *token;
-    char *temp = NULL;
-    if (current) {
-        val = arena_allocator_alloc(aa,
-                                     DEFAULT_ALIGNMENT,
-                                     sizeof(struct minjson_value));
-        if (!val)
-            goto fail_allocator;
+    struct minjson_object_entry *entries = parser->entries + frame->base;
+    size_t len = parser->entries_len - frame->base;
+    size_t slot;
+    size_t i;
+    uint32_t hash;
 
-        switch (current->type) {
-            case TK_OPEN_CB:
-                val->type = MJ_OBJECT;
-                val->value.object = minjson_parse_object(&current, aa, error);
-                if (!val->value.object)
-                    return NULL;
-                break;
-            case TK_OPEN_SB:
-                val->type = MJ_ARRAY;
-                val->value.array = minjson_parse_array(&current, aa, error);
-                if (!val->value.array)
-                    return NULL;
-                break;
-            case TK_TRUE:
-                val->type = MJ_TRUE;
-                val->value.boolean = 1;
-                break;
-            case TK_FALSE:
-                val->type = MJ_FALSE;
-                val->value.boolean = 0;
-                break;
-            case TK_NULL:
-                val->type = MJ_NULL;
-                val->value.boolean = 0;
-                break;
-            case TK_NUMBER: 
-                temp = arena_allocator_alloc(aa,
-                                             DEFAULT_ALIGNMENT,
-                                             current->len + 1);
-                if (!temp)
-                    goto fail_allocator;
+    *position = PARSER_NO_DUPLICATE;
 
-                val->type = MJ_NUMBER;
+    if (!frame->set && (len < PARSER_DUPLICATE_SCAN_MAX || len >= UINT32_MAX / 4)) {
+        for (i = 0; i < len; ++i) {
+            if (minjson_key_equal(key, key_len, &entries[i])) {
+                *position = i;
+                break;
+            }
+        }
+        return 0;
+    }
 
-                memcpy(temp, current->lexeme, current->len);
-                temp[current->len] = '\0';
+    /* At most half full, counting key */
+    if (!frame->set || 2 * (len + 1) > frame->set_mask + 1)
+        if (parser_key_set_resize(parser, frame, len) == -1)
+            return -1;
 
-                val->value.number = strtod(temp, NULL);
-                break;
-            case TK_STRING:
-                val->type = MJ_STRING;
-                val->value.string = minjson_string_decode_escape_sequence(current, aa, error);
-                if (!val->value.string)
-                    return NULL;
-                break;
-            default:
-                goto fail_unexpected_token;
-                break;
+    hash = minjson_hash_key(key, key_len);
+    for (slot = hash & frame->set_mask;
+         frame->set[slot].entry;
+         slot = (slot + 1) & frame->set_mask) {
+        i = frame->set[slot].entry - 1;
+        if (frame->set[slot].hash == hash && minjson_key_equal(key, key_len, &entries[i])) {
+            *position = i;
+            return 0;
         }
-    } else {
-        goto fail_expected_value;
     }
 
-    *token = current;
+    /* Its entry is pushed at len once its value is parsed */
+    frame->set[slot].hash = hash;
+    frame->set[slot].entry = (uint32_t)(len + 1);
 
-    return val;
+    return 0;
+}
 
-fail_allocator:
-    minjson_error_set(error, MJ_ERR_ALLOCATOR, "memory allocator failed", 0, 0);
-    return NULL;
+static int parser_tape_init(struct minjson_parser *parser, size_t input_len)
+{
+    /* A non NULL tape is what tells the parser to build one */
+    parser->tape = arena_allocator_alloc(parser->scratch,
+                                         DEFAULT_ALIGNMENT,
+                                         PARSER_INITIAL_TAPE * sizeof(uint64_t));
+    if (!parser->tape)
+        return -1;
+    parser->tape_capacity = PARSER_INITIAL_TAPE;
 
-/* Purely to handle an empty JSON, object and array have their own */
-fail_expected_value: 
-    minjson_error_set(error,
-                      MJ_ERR_VALUE,
-                      "syntax error, expected value at line%zu, column %zu",
-                      1,
-                      1);
-    return NULL;
+    /* A string decodes to at most its length between the quotes, so along
+     * with its nul it never takes more than its own token */
+    parser->strings = arena_allocator_alloc(parser->scratch, 1, input_len + 1);
+    if (!parser->strings)
+        return -1;
 
-fail_unexpected_token:
-    minjson_error_set(error,
-                      MJ_ERR_TOKEN,
-                      "syntax error, unexpected token at line %zu, column %zu",
-                      current->line,
-                      current->column);
-    return NULL;
+    return 0;
 }
 
-/* ================== Public Facing API ================== */
-
-/* raw_json must be null terminated */
-struct minjson *minjson_parse(struct arena_allocator *doc_aa,
-                              const char *raw_json,
-                              struct minjson_error *error)
+static int parser_tape_push(struct minjson_parser *parser, uint64_t word)
 {
-    struct minjson *doc = NULL;
-    struct minjson_lexer *lexer = NULL;
-    struct minjson_token *current = NULL;
-    /* If doc_aa belongs to caller, dont free on error */
-    unsigned char free_doc_aa = 0;
+    uint64_t *tape;
 
-    if (!doc_aa) {
-        free_doc_aa = 1;
-        doc_aa = arena_allocator_new(DEFAULT_ARENA_SIZE);
-        if (!doc_aa)
-            goto fail_allocator;
+    if (parser->tape_len == parser->tape_capacity) {
+        tape = arena_allocator_alloc(parser->scratch,
+                                     DEFAULT_ALIGNMENT,
+                                     2 * parser->tape_capacity * sizeof(*tape));
+        if (!tape)
+            return -1;
+
+        memcpy(tape, parser->tape, parser->tape_len * sizeof(*tape));
+        parser->tape = tape;
+        parser->tape_capacity *= 2;
     }
-    doc = minjson_new(doc_aa);
-    if (!doc)
-        goto fail_allocator;
 
-    lexer = minjson_lexer_new(NULL, raw_json);
-    if (!lexer)
-        goto fail_allocator;
+    parser->tape[parser->tape_len++] = word;
 
-    /* Lexical analysis here */
-    if (minjson_lexer_tokenize(lexer, error) == -1)
-        goto fail;
+    return 0;
+}
 
-    /* Parsing here */
-    current = lexer->tk_head;
-    doc->root = minjson_parse_value(&current, doc_aa, error);
-    if (!doc->root)
-        goto fail;
+/* Decodes token at the end of the string buffer and emits its word */
+static int parser_tape_push_string(struct minjson_parser *parser,
+                                   struct minjson_token *token,
+                                   struct minjson_error *error)
+{
+    size_t offset = parser->strings_len;
+    char *string = parser->strings + offset;
+    size_t len = token->len;
+
+    /* Room for token->len bytes is always left, decoding never needs more */
+    if (!token->escaped)
+        memcpy(string, token->lexeme, len);
+    else if (minjson_string_unescape(token, string, &len, error) == -1)
+        return -1;
 
-    /* There shouldn't be anymore token */
-    if (current->next)
-        goto fail_unexpected_token;
-        
-    arena_allocator_destroy(lexer->aallocator);
+    ASSERT(len <= token->len);
+    string[len] = '\0';
+    parser->strings_len += len + 1;
 
-    return doc;
+    if (parser_tape_push(parser, TAPE_WORD(MJ_STRING, offset)) == -1) {
+        minjson_error_set_allocator(error, parser->scratch);
+        return -1;
+    }
 
-fail_allocator:
-    minjson_error_set(error, MJ_ERR_ALLOCATOR, "memory allocator failed", 0, 0);
-    if (free_doc_aa)
-        arena_allocator_destroy(doc_aa);
-    if (lexer)
-        arena_allocator_destroy(lexer->aallocator);
-    return NULL;
+    return 0;
+}
 
-fail_unexpected_token:
-    minjson_error_set(error,
-                      MJ_ERR_TOKEN,
-                      "syntax error, unexpected token at line %zu, column %zu",
-                      current->line,
-                      current->column);
-    if (lexer)
-        arena_allocator_destroy(lexer->aallocator);
-    if (free_doc_aa)
-        arena_allocator_destroy(doc_aa);
-    return NULL;
+static void parser_tape_attach_value(struct minjson_parser *parser)
+{
+    struct minjson_parser_frame *frame;
 
-fail:
-    if (free_doc_aa)
-        arena_allocator_destroy(doc_aa);
-    if (lexer)
-        arena_allocator_destroy(lexer->aallocator);
-    return NULL;
+    if (parser->depth == 0) {
+        parser->state = PS_DONE;
+        return;
+    }
 
+    frame = &parser->frames[parser->depth - 1];
+    ++frame->count;
+    parser->state = frame->type == MJ_OBJECT ? PS_OBJECT_NEXT : PS_ARRAY_NEXT;
 }
 
-struct minjson_value *minjson_get(struct minjson *doc, const char *key)
+/* Emits the close word and patches the open word to point at it */
+static int parser_tape_close_container(struct minjson_parser *parser,
+                                       struct minjson_error *error)
 {
-    struct minjson_value *value;
+    struct minjson_parser_frame *frame;
+    size_t close;
 
-    if (!doc || doc->root->type != MJ_OBJECT)
-        return NULL;
+    ASSERT(parser->depth > 0);
 
-    value = minjson_object_get(doc->root, key);
+    frame = &parser->frames[--parser->depth];
+    if (frame->type == MJ_OBJECT) {
+        parser_release_key_set(parser, frame->set, frame->set_mask);
+        parser->entries_len = frame->base;
+    }
 
-    return value;
+    close = parser->tape_len;
+    if (parser_tape_push(parser, TAPE_WORD(TAPE_CLOSE, frame->open)) == -1) {
+        minjson_error_set_allocator(error, parser->scratch);
+        return -1;
+    }
+    parser->tape[frame->open] |= close;
+    parser->tape[frame->open + 1] = frame->count;
+
+    parser_tape_attach_value(parser);
+
+    return 0;
+}
+
+static int parser_tape_accept_value(struct minjson_parser *parser,
+                                    struct minjson_token *token,
+                                    struct minjson_error *error)
+{
+    enum minjson_type type;
+    uint64_t bits;
+
+    switch (token->type) {
+        case TK_OPEN_CB:
+        case TK_OPEN_SB:
+            type = token->type == TK_OPEN_CB ? MJ_OBJECT : MJ_ARRAY;
+            /* The open word gets its payload and count once closed */
+            if (parser_push_frame(parser, type, NULL) == -1 ||
+                parser_tape_push(parser, TAPE_WORD(type, 0)) == -1 ||
+                parser_tape_push(parser, 0) == -1)
+                goto fail_scratch_allocator;
+            parser->state = type == MJ_OBJECT ? PS_OBJECT_FIRST : PS_ARRAY_FIRST;
+            return 0;
+        case TK_TRUE:
+            if (parser_tape_push(parser, TAPE_WORD(MJ_TRUE, 0)) == -1)
+                goto fail_scratch_allocator;
+            break;
+        case TK_FALSE:
+            if (parser_tape_push(parser, TAPE_WORD(MJ_FALSE, 0)) == -1)
+                goto fail_scratch_allocator;
+            break;
+        case TK_NULL:
+            if (parser_tape_push(parser, TAPE_WORD(MJ_NULL, 0)) == -1)
+                goto fail_scratch_allocator;
+            break;
+        case TK_NUMBER:
+            memcpy(&bits, &token->number, sizeof(bits));
+            if (parser_tape_push(parser, TAPE_WORD(MJ_NUMBER, token->number_type)) == -1 ||
+                parser_tape_push(parser, bits) == -1)
+                goto fail_scratch_allocator;
+            break;
+        case TK_STRING:
+            if (parser_tape_push_string(parser, token, error) == -1)
+                return -1;
+            break;
+        default:
+            goto fail_unexpected_token;
+    }
+
+    parser_tape_attach_value(parser);
+
+    return 0;
+
+fail_scratch_allocator:
+    minjson_error_set_allocator(error, parser->scratch);
+    return -1;
+
+fail_unexpected_token:
+    minjson_error_set(error,
+                      MJ_ERR_TOKEN,
+                      "syntax error, unexpected token at line %zu, column %zu",
+                      token->line,
+                      token->column);
+    return -1;
+}
+
+/* Keys only need to be looked up to reject duplicates, every other policy
+ * keeps all entries on the tape and settles it on lookup */
+static int parser_tape_accept_key(struct minjson_parser *parser,
+                                  struct minjson_token *token,
+                                  struct minjson_error *error)
+{
+    struct minjson_parser_frame *frame = &parser->frames[parser->depth - 1];
+    size_t offset = parser->strings_len;
+    char *key;
+    size_t key_len;
+
+    if (parser_tape_push_string(parser, token, error) == -1)
+        return -1;
+
+    if (parser->duplicate_policy == MJ_DUPLICATE_REJECT) {
+        /* The string buffer never moves, key stays valid */
+        key = parser->strings + offset;
+        key_len = parser->strings_len - offset - 1;
+        if (parser_find_key(parser, frame, key, key_len, &frame->duplicate) == -1)
+            goto fail_scratch_allocator;
+
+        if (frame->duplicate != PARSER_NO_DUPLICATE) {
+            minjson_error_set(error,
+                              MJ_ERR_OBJECT,
+                              "found duplicate key at line %zu, column %zu",
+                              token->line, token->column);
+            return -1;
+        }
+
+        if (parser_push_entry(parser, key, key_len, NULL) == -1)
+            goto fail_scratch_allocator;
+    }
+
+    parser->state = PS_OBJECT_COLON;
+
+    return 0;
+
+fail_scratch_allocator:
+    minjson_error_set_allocator(error, parser->scratch);
+    return -1;
+}
+
+/* Hands a complete value to its parent and decides what comes next */
+static int parser_attach_value(struct minjson_parser *parser,
+                               struct minjson_value *value,
+                               struct minjson_error *error)
+{
+    struct minjson_parser_frame *frame;
+
+    if (parser->depth == 0) {
+        parser->root = value;
+        parser->state = PS_DONE;
+        return 0;
+    }
+
+    frame = &parser->frames[parser->depth - 1];
+    if (frame->type == MJ_OBJECT) {
+        if (frame->duplicate == PARSER_NO_DUPLICATE) {
+            if (parser_push_entry(parser, frame->key, frame->key_len, value) == -1)
+                goto fail_scratch_allocator;
+        } else if (parser->duplicate_policy == MJ_DUPLICATE_LAST_WINS) {
+            parser->entries[frame->base + frame->duplicate].value = value;
+        }
+        parser->state = PS_OBJECT_NEXT;
+    } else {
+        if (parser_push_value(parser, value) == -1)
+            goto fail_scratch_allocator;
+        parser->state = PS_ARRAY_NEXT;
+    }
+
+    return 0;
+
+fail_scratch_allocator:
+    minjson_error_set_allocator(error, parser->scratch);
+    return -1;
+}
+
+/* Moves the entries of the innermost object off the entry stack */
+static int parser_close_object(struct minjson_parser *parser,
+                               struct minjson_parser_frame *frame)
+{
+    struct minjson_object *object = frame->container->value.object;
+
+    parser_release_key_set(parser, frame->set, frame->set_mask);
+
+    object->len = parser->entries_len - frame->base;
+    parser->entries_len = frame->base;
+    if (!object->len)
+        return 0;
+
+    object->entries = arena_allocator_alloc(parser->aallocator,
+                                            DEFAULT_ALIGNMENT,
+                                            object->len * sizeof(struct minjson_object_entry));
+    if (!object->entries)
+        return -1;
+
+    memcpy(object->entries,
+           parser->entries + frame->base,
+           object->len * sizeof(struct minjson_object_entry));
+
+    /* Built now rather than on first lookup, the document stays read only
+     * so any number of threads can look keys up without locking */
+    if (object->len >= parser->index_threshold)
+        return minjson_object_build_index(object, parser->aallocator);
+
+    return 0;
+}
+
+/* Moves the elements of the innermost array off the value stack */
+static int parser_close_array(struct minjson_parser *parser,
+                              struct minjson_parser_frame *frame)
+{
+    struct minjson_array *array = frame->container->value.array;
+
+    array->len = parser->values_len - frame->base;
+    parser->values_len = frame->base;
+    if (!array->len)
+        return 0;
+
+    array->values = arena_allocator_alloc(parser->aallocator,
+                                          DEFAULT_ALIGNMENT,
+                                          array->len * sizeof(struct minjson_value *));
+    if (!array->values)
+        return -1;
+
+    memcpy(array->values,
+           parser->values + frame->base,
+           array->len * sizeof(struct minjson_value *));
+
+    return 0;
+}
+
+static int parser_close_container(struct minjson_parser *parser,
+                                  struct minjson_error *error)
+{
+    struct minjson_parser_frame *frame;
+    int status;
+
+    if (parser->tape)
+        return parser_tape_close_container(parser, error);
+
+    ASSERT(parser->depth > 0);
+
+    /* Its entries or elements are the top of their stack, copied once */
+    frame = &parser->frames[--parser->depth];
+    if (frame->type == MJ_OBJECT)
+        status = parser_close_object(parser, frame);
+    else
+        status = parser_close_array(parser, frame);
+
+    if (status == -1) {
+        minjson_error_set_allocator(error, parser->aallocator);
+        return -1;
+    }
+
+    return parser_attach_value(parser, frame->container, error);
+}
+
+/* The string in token as the DOM keeps it, see minjson_string */
+static const char *parser_string(struct minjson_parser *parser,
+                                 struct minjson_token *token,
+                                 size_t *len,
+                                 struct minjson_error *error)
+{
+    /* Only minjson_parse_insitu sets insitu, the input is its own then. The
+     * lexer is already past the closing quote the nul goes on. */
+    char *insitu = (char *)token->lexeme;
+
+    if (parser->insitu) {
+        *len = token->len;
+        if (token->escaped && minjson_string_unescape(token, insitu, len, error) == -1)
+            return NULL;
+        insitu[*len] = '\0';
+        return insitu;
+    }
+
+    if (token->escaped)
+        return minjson_string_decode_escape_sequence(token, parser->aallocator, len, error);
+
+    *len = token->len;
+    if (parser->zero_copy_strings)
+        return token->lexeme;
+
+    return minjson_string_copy(token, parser->aallocator, error);
+}
+
+static int parser_accept_value(struct minjson_parser *parser,
+                               struct minjson_token *token,
+                               struct minjson_error *error)
+{
+    struct arena_allocator *aa = parser->aallocator;
+    struct minjson_value *val = NULL;
+    struct minjson_lazy_number *lazy;
+    struct minjson_string *string;
+    size_t size = sizeof(struct minjson_value);
+
+    if (parser->tape)
+        return parser_tape_accept_value(parser, token, error);
+
+    if (token->type == TK_NUMBER && token->number_type == MJ_NUMBER_LAZY)
+        size = sizeof(struct minjson_lazy_number);
+    else if (token->type == TK_STRING)
+        size = sizeof(struct minjson_string);
+
+    val = arena_allocator_alloc(aa, DEFAULT_ALIGNMENT, size);
+    if (!val)
+        goto fail_allocator;
+
+    switch (token->type) {
+        case TK_OPEN_CB:
+            val->type = MJ_OBJECT;
+            val->value.object = \
+                arena_allocator_alloc(aa,
+                                      DEFAULT_ALIGNMENT,
+                                      sizeof(struct minjson_object));
+            if (!val->value.object)
+                goto fail_allocator;
+            val->value.object->entries = NULL;
+            val->value.object->len = 0;
+            val->value.object->index = NULL;
+            val->value.object->index_mask = 0;
+
+            if (parser_push_frame(parser, MJ_OBJECT, val) == -1)
+                goto fail_scratch_allocator;
+            parser->state = PS_OBJECT_FIRST;
+            return 0;
+        case TK_OPEN_SB:
+            val->type = MJ_ARRAY;
+            val->value.array = \
+                arena_allocator_alloc(aa,
+                                      DEFAULT_ALIGNMENT,
+                                      sizeof(struct minjson_array));
+            if (!val->value.array)
+                goto fail_allocator;
+            val->value.array->values = NULL;
+            val->value.array->len = 0;
+
+            if (parser_push_frame(parser, MJ_ARRAY, val) == -1)
+                goto fail_scratch_allocator;
+            parser->state = PS_ARRAY_FIRST;
+            return 0;
+        case TK_TRUE:
+            val->type = MJ_TRUE;
+            val->value.boolean = 1;
+            break;
+        case TK_FALSE:
+            val->type = MJ_FALSE;
+            val->value.boolean = 0;
+            break;
+        case TK_NULL:
+            val->type = MJ_NULL;
+            val->value.boolean = 0;
+            break;
+        case TK_NUMBER: 
+            val->type = MJ_NUMBER;
+            val->number_type = token->number_type;
+            if (token->number_type == MJ_NUMBER_LAZY) {
+                lazy = (struct minjson_lazy_number *)val;
+#if MINJSON_HAVE_ATOMICS
+                atomic_init(&lazy->decoded, MJ_NUMBER_LAZY);
+#else
+                lazy->decoded = MJ_NUMBER_LAZY;
+#endif
+                lazy->lexeme = token->lexeme;
+                lazy->len = token->len;
+            } else {
+                val->value.number = token->number;
+            }
+            break;
+        case TK_STRING:
+            string = (struct minjson_string *)val;
+            val->type = MJ_STRING;
+            val->value.string = parser_string(parser, token, &string->len, error);
+            if (!val->value.string)
+                return -1;
+            break;
+        default:
+            goto fail_unexpected_token;
+    }
+
+    if (parser_attach_value(parser, val, error) == -1)
+        return -1;
+
+    return 0;
+
+fail_allocator:
+    minjson_error_set_allocator(error, aa);
+    return -1;
+
+fail_scratch_allocator:
+    minjson_error_set_allocator(error, parser->scratch);
+    return -1;
+
+fail_unexpected_token:
+    minjson_error_set(error,
+                      MJ_ERR_TOKEN,
+                      "syntax error, unexpected token at line %zu, column %zu",
+                      token->line,
+                      token->column);
+    return -1;
+}
+
+static int parser_accept_key(struct minjson_parser *parser,
+                             struct minjson_token *token,
+                             struct minjson_error *error)
+{
+    struct minjson_parser_frame *frame = &parser->frames[parser->depth - 1];
+    const char *key;
+    size_t key_len;
+
+    if (parser->tape)
+        return parser_tape_accept_key(parser, token, error);
+
+    key = parser_string(parser, token, &key_len, error);
+    if (!key)
+        return -1;
+
+    frame->duplicate = PARSER_NO_DUPLICATE;
+    if (parser->duplicate_policy != MJ_DUPLICATE_NO_CHECK) {
+        if (parser_find_key(parser, frame, key, key_len, &frame->duplicate) == -1) {
+            minjson_error_set_allocator(error, parser->scratch);
+            return -1;
+        }
+        if (frame->duplicate != PARSER_NO_DUPLICATE &&
+            parser->duplicate_policy == MJ_DUPLICATE_REJECT) {
+            minjson_error_set(error,
+                              MJ_ERR_OBJECT,
+                              "found duplicate key at line %zu, column %zu",
+                              token->line, token->column);
+            return -1;
+        }
+    }
+
+    frame->key = key;
+    frame->key_len = key_len;
+    parser->state = PS_OBJECT_COLON;
+
+    return 0;
+}
+
+/**
+ * Feeds the next token to the parser, token is NULL at end of input.
+ * 
+ * string -> colon -> value, if delimiter repeat cycle, else expect '}'
+ * value, if delimiter repeat cycle, else expect ']'
+ */
+static int parser_accept(struct minjson_parser *parser,
+                         struct minjson_token *token,
+                         struct minjson_error *error)
+{
+    switch (parser->state) {
+        case PS_VALUE:
+            if (!token) {
+                if (parser->depth == 0)
+                    goto fail_empty;
+                if (parser->frames[parser->depth - 1].type == MJ_OBJECT)
+                    goto fail_expected_value;
+                goto fail_expected_closing_bracket;
+            }
+            if (parser_accept_value(parser, token, error) == -1)
+                return -1;
+            break;
+        case PS_OBJECT_FIRST:
+            if (token && token->type == TK_CLOSE_CB) {
+                if (parser_close_container(parser, error) == -1)
+                    return -1;
+                break;
+            }
+            /* fall through */
+        case PS_OBJECT_KEY:
+            if (!token)
+                goto fail_expected_closing_brace;
+            if (token->type != TK_STRING)
+                goto fail_expected_string;
+            if (parser_accept_key(parser, token, error) == -1)
+                return -1;
+            break;
+        case PS_OBJECT_COLON:
+            if (!token || token->type != TK_COLON)
+                goto fail_expected_colon;
+            parser->state = PS_VALUE;
+            break;
+        case PS_OBJECT_NEXT:
+            if (token && token->type == TK_DELIMITER) {
+                parser->state = PS_OBJECT_KEY;
+            } else if (token && token->type == TK_CLOSE_CB) {
+                if (parser_close_container(parser, error) == -1)
+                    return -1;
+            } else {
+                goto fail_expected_closing_brace;
+            }
+            break;
+        case PS_ARRAY_FIRST:
+            if (!token)
+                goto fail_expected_closing_bracket;
+            if (token->type == TK_CLOSE_SB) {
+                if (parser_close_container(parser, error) == -1)
+                    return -1;
+            } else if (parser_accept_value(parser, token, error) == -1) {
+                return -1;
+            }
+            break;
+        case PS_ARRAY_NEXT:
+            if (token && token->type == TK_DELIMITER) {
+                parser->state = PS_VALUE;
+            } else if (token && token->type == TK_CLOSE_SB) {
+                if (parser_close_container(parser, error) == -1)
+                    return -1;
+            } else {
+                goto fail_expected_closing_bracket;
+            }
+            break;
+        case PS_DONE:
+            /* There shouldn't be anymore token */
+            if (token)
+                goto fail_unexpected_token;
+            break;
+    }
+
+    if (token) {
+        parser->prev_line = token->line;
+        parser->prev_column = token->column;
+    }
+
+    return 0;
+
+/* Purely to handle an empty JSON, object and array have their own */
+fail_empty: 
+    minjson_error_set(error,
+                      MJ_ERR_VALUE,
+                      "syntax error, expected value at line%zu, column %zu",
+                      1,
+                      1);
+    return -1;
+
+fail_unexpected_token:
+    minjson_error_set(error,
+                      MJ_ERR_TOKEN,
+                      "syntax error, unexpected token at line %zu, column %zu",
+                      parser->prev_line,
+                      parser->prev_column);
+    return -1;
+
+fail_expected_string:
+    minjson_error_set(error,
+                      MJ_ERR_OBJECT,
+                      "syntax error, expected string at line %zu, column %zu",
+                      parser->prev_line, parser->prev_column);
+    return -1;
+
+fail_expected_colon:
+    minjson_error_set(error,
+                      MJ_ERR_OBJECT,
+                      "syntax error, expected ':' at line %zu, column %zu",
+                      parser->prev_line, parser->prev_column);
+    return -1;
+
+fail_expected_value:
+    minjson_error_set(error,
+                      MJ_ERR_OBJECT,
+                      "syntax error, expected value at line %zu, column %zu",
+                      parser->prev_line, parser->prev_column);
+    return -1;
+
+fail_expected_closing_brace:
+    minjson_error_set(error,
+                      MJ_ERR_OBJECT,
+                      "syntax error, expected '}' at end of object, line %zu, column %zu",
+                      parser->prev_line, parser->prev_column);
+    return -1;
+
+fail_expected_closing_bracket:
+    minjson_error_set(error,
+                      MJ_ERR_OBJECT,
+                      "syntax error, expected ']' at end of array, line %zu, column %zu",
+                      parser->prev_line, parser->prev_column);
+    return -1;
+}
+
+/* ================== Public Facing API ================== */
+
+/* raw_json must be null terminated */
+struct minjson *minjson_parse(struct arena_allocator *doc_aa,
+                              const char *raw_json,
+                              struct minjson_error *error)
+{
+    return minjson_parse_ex(doc_aa, raw_json, NULL, error);
+}
+
+/* Arenas of a parse in progress */
+struct minjson_parse_context {
+    struct arena_allocator *doc_aa;
+    struct arena_allocator *scratch_aa;
+    struct arena_mark doc_mark;
+    struct arena_mark scratch_mark;
+    size_t doc_start;
+    /* If doc_aa or scratch_aa belongs to caller, dont free on error */
+    unsigned char free_doc_aa;
+    unsigned char free_scratch_aa;
+};
+
+static void minjson_parse_abort(struct minjson_parse_context *ctx)
+{
+    if (ctx->free_doc_aa)
+        arena_allocator_destroy(ctx->doc_aa);
+    else
+        arena_allocator_rollback_to(ctx->doc_aa, ctx->doc_mark);
+    if (ctx->scratch_aa && ctx->scratch_aa != ctx->doc_aa)
+        minjson_scratch_release(ctx->scratch_aa, ctx->free_scratch_aa, ctx->scratch_mark);
+}
+
+/* Creates or marks the document and scratch arenas, copies_strings unless
+ * the document's strings stay in the input */
+static int minjson_parse_begin(struct minjson_parse_context *ctx,
+                               struct arena_allocator *doc_aa,
+                               const struct minjson_parse_options *options,
+                               size_t input_len,
+                               int copies_strings,
+                               struct minjson_error *error)
+{
+    struct arena_allocator_stats doc_stats;
+
+    ctx->doc_aa = doc_aa;
+    ctx->scratch_aa = NULL;
+    ctx->free_doc_aa = 0;
+    ctx->free_scratch_aa = 0;
+
+    if (!doc_aa) {
+        ctx->doc_aa = arena_allocator_new_with(minjson_doc_arena_size(options, input_len, copies_strings),
+                                               options->backend,
+                                               options->backend_user);
+        if (!ctx->doc_aa) {
+            minjson_error_set_allocator(error, NULL);
+            return -1;
+        }
+        ctx->free_doc_aa = 1;
+    } else {
+        /* Whatever a failed parse leaves in caller's doc_aa is rolled back */
+        ctx->doc_mark = arena_allocator_mark(doc_aa);
+    }
+    arena_allocator_get_stats(ctx->doc_aa, &doc_stats);
+    ctx->doc_start = doc_stats.used + doc_stats.padding;
+
+    /* When scratch_aa is doc_aa, scratch stays with the document and goes
+     * away with it, failed parses are still rolled back through doc_mark */
+    ctx->scratch_aa = options->scratch_aa;
+    if (!ctx->scratch_aa) {
+        ctx->free_scratch_aa = 1;
+        ctx->scratch_aa = arena_allocator_new_with(minjson_scratch_arena_size(options),
+                                                   options->backend,
+                                                   options->backend_user);
+        if (!ctx->scratch_aa) {
+            minjson_error_set_allocator(error, NULL);
+            minjson_parse_abort(ctx);
+            return -1;
+        }
+    } else if (ctx->scratch_aa != ctx->doc_aa) {
+        ctx->scratch_mark = arena_allocator_mark(ctx->scratch_aa);
+    }
+
+    return 0;
+}
+
+/* Releases scratch and returns how much of doc_aa the parse took */
+static size_t minjson_parse_end(struct minjson_parse_context *ctx)
+{
+    struct arena_allocator_stats doc_stats;
+
+    arena_allocator_get_stats(ctx->doc_aa, &doc_stats);
+    if (ctx->scratch_aa != ctx->doc_aa)
+        minjson_scratch_release(ctx->scratch_aa, ctx->free_scratch_aa, ctx->scratch_mark);
+
+    return doc_stats.used + doc_stats.padding - ctx->doc_start;
+}
+
+/* Lexing and parsing happen in a single pass, every token is handed
+ * to the parser as soon as it is scanned */
+static int minjson_parse_run(struct minjson_parser *parser,
+                             const char *raw_json,
+                             size_t input_len,
+                             const struct minjson_parse_options *options,
+                             struct minjson_error *error)
+{
+    struct minjson_lexer *lexer;
+    struct minjson_token token;
+    int status;
+
+    lexer = lexer_new(parser->scratch, raw_json, input_len);
+    if (!lexer)
+        goto fail_allocator;
+
+    /* The tape has nowhere to cache a decoded number, and copies its
+     * strings in a buffer of its own anyway */
+    lexer->lazy_numbers = options->lazy_numbers && !parser->tape;
+    parser->zero_copy_strings = options->zero_copy_strings && !parser->tape;
+
+    do {
+        status = lexer_next_token(lexer, &token, error);
+        if (status == -1)
+            return -1;
+
+        if (parser_accept(parser, status ? &token : NULL, error) == -1)
+            return -1;
+    } while (status);
+
+    return 0;
+
+fail_allocator:
+    minjson_error_set_allocator(error, parser->scratch);
+    return -1;
+}
+
+/* minjson_parse_n_ex, strings decoded in raw_json itself if insitu */
+static struct minjson *minjson_parse_dom(struct arena_allocator *doc_aa,
+                                         const char *raw_json,
+                                         size_t input_len,
+                                         const struct minjson_parse_options *options,
+                                         int insitu,
+                                         struct minjson_error *error)
+{
+    struct minjson_parse_options default_options;
+    struct minjson_parse_context ctx;
+    struct minjson *doc = NULL;
+    struct minjson_parser parser;
+
+    if (!options) {
+        default_options = minjson_parse_options_new();
+        options = &default_options;
+    }
+
+    if (minjson_parse_begin(&ctx,
+                            doc_aa,
+                            options,
+                            input_len,
+                            !insitu && !options->zero_copy_strings,
+                            error) == -1)
+        return NULL;
+
+    doc = minjson_new(ctx.doc_aa);
+    if (!doc)
+        goto fail_doc_allocator;
+
+    parser_init(&parser,
+                ctx.doc_aa,
+                ctx.scratch_aa,
+                minjson_object_index_threshold(options),
+                options->duplicate_keys);
+    parser.insitu = insitu;
+
+    if (minjson_parse_run(&parser, raw_json, input_len, options, error) == -1)
+        goto fail;
+
+    doc->root = parser.root;
+    doc->footprint = minjson_parse_end(&ctx);
+
+    return doc;
+
+fail_doc_allocator:
+    minjson_error_set_allocator(error, ctx.doc_aa);
+fail:
+    minjson_parse_abort(&ctx);
+    return NULL;
+
+}
+
+struct minjson *minjson_parse_ex(struct arena_allocator *doc_aa,
+                                 const char *raw_json,
+                                 const struct minjson_parse_options *options,
+                                 struct minjson_error *error)
+{
+    return minjson_parse_dom(doc_aa, raw_json, strlen(raw_json), options, 0, error);
+}
+
+struct minjson *minjson_parse_n(struct arena_allocator *doc_aa,
+                                const char *raw_json,
+                                size_t len,
+                                struct minjson_error *error)
+{
+    return minjson_parse_dom(doc_aa, raw_json, len, NULL, 0, error);
+}
+
+struct minjson *minjson_parse_n_ex(struct arena_allocator *doc_aa,
+                                   const char *raw_json,
+                                   size_t len,
+                                   const struct minjson_parse_options *options,
+                                   struct minjson_error *error)
+{
+    return minjson_parse_dom(doc_aa, raw_json, len, options, 0, error);
+}
+
+struct minjson *minjson_parse_insitu(struct arena_allocator *doc_aa,
+                                     char *raw_json,
+                                     const struct minjson_parse_options *options,
+                                     struct minjson_error *error)
+{
+    return minjson_parse_dom(doc_aa, raw_json, strlen(raw_json), options, 1, error);
+}
+
+#if ARENA_HAVE_MMAP
+
+/* A mapped file kept alive by every arena chunk of the document parsed from
+ * it, and by minjson_parse_file until parsing is done. Chunks come from the
+ * backend the options asked for. */
+struct minjson_file_mapping {
+    const struct arena_backend *backend;
+    void *backend_user;
+    void *map;
+    size_t len;
+    size_t refs;
+};
+
+static void minjson_file_mapping_release(struct minjson_file_mapping *mapping)
+{
+    if (--mapping->refs)
+        return;
+
+    if (mapping->map)
+        munmap(mapping->map, mapping->len);
+    free(mapping);
+}
+
+static void *minjson_file_backend_alloc(void *user, size_t *size)
+{
+    struct minjson_file_mapping *mapping = user;
+    void *ptr = mapping->backend->alloc(mapping->backend_user, size);
+
+    if (ptr)
+        ++mapping->refs;
+
+    return ptr;
+}
+
+static void minjson_file_backend_free(void *user, void *ptr, size_t size)
+{
+    struct minjson_file_mapping *mapping = user;
+
+    mapping->backend->free(mapping->backend_user, ptr, size);
+    minjson_file_mapping_release(mapping);
+}
+
+static const struct arena_backend minjson_file_backend = {
+    minjson_file_backend_alloc,
+    minjson_file_backend_free
+};
+
+/* Maps the file at path read only, NULL map for an empty file */
+static int minjson_file_map(struct minjson_file_mapping *mapping, const char *path)
+{
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == -1 || st.st_size < 0 || (uint64_t)st.st_size > SIZE_MAX) {
+        close(fd);
+        return -1;
+    }
+
+    mapping->len = (size_t)st.st_size;
+    if (mapping->len) {
+        mapping->map = mmap(NULL, mapping->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping->map == MAP_FAILED) {
+            mapping->map = NULL;
+            close(fd);
+            return -1;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(mapping->map, mapping->len, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_WILLNEED
+        madvise(mapping->map, mapping->len, MADV_WILLNEED);
+#endif
+    }
+    close(fd);
+
+    return 0;
+}
+
+struct minjson *minjson_parse_file(const char *path,
+                                   const struct minjson_parse_options *options,
+                                   struct minjson_error *error)
+{
+    struct minjson_parse_options file_options;
+    struct minjson_file_mapping *mapping;
+    struct minjson *doc;
+
+    file_options = options ? *options : minjson_parse_options_new();
+
+    mapping = malloc(sizeof(struct minjson_file_mapping));
+    if (!mapping) {
+        minjson_error_set_allocator(error, NULL);
+        return NULL;
+    }
+    mapping->backend = file_options.backend ? file_options.backend : &arena_backend_malloc;
+    mapping->backend_user = file_options.backend_user;
+    mapping->map = NULL;
+    mapping->len = 0;
+    mapping->refs = 1;
+
+    if (minjson_file_map(mapping, path) == -1) {
+        free(mapping);
+        minjson_error_set(error, MJ_ERR_FILE, "could not open or map the file", 0, 0);
+        return NULL;
+    }
+
+    file_options.backend = &minjson_file_backend;
+    file_options.backend_user = mapping;
+    doc = minjson_parse_n_ex(NULL,
+                             mapping->map ? mapping->map : "",
+                             mapping->len,
+                             &file_options,
+                             error);
+    minjson_file_mapping_release(mapping);
+
+    return doc;
+}
+
+#endif
+
+/* ================== Push parsing ================== */
+
+/* A parse fed chunk by chunk. It lives in scratch and goes away with it.
+ * The token cut by the end of a chunk waits in carry for the next one.
+ * Carry is always scanned up to carry_len, a string in it only needs the
+ * bytes of the next chunks scanned for its end. */
+struct minjson_stream {
+    struct minjson_parse_context ctx;
+    struct minjson_parser parser;
+    struct minjson_lexer *lexer;
+    struct minjson *doc;
+    struct minjson_error *error;
+    char *carry;
+    size_t carry_len;
+    size_t carry_capacity;
+    int carry_escape; /* The string in carry ends in an unfinished \ escape */
+    int failed;
+};
+
+#define STREAM_INITIAL_CARRY 256
+
+struct minjson_stream *minjson_stream_new(struct arena_allocator *doc_aa,
+                                          const struct minjson_parse_options *options,
+                                          struct minjson_error *error)
+{
+    struct minjson_parse_options default_options;
+    struct minjson_parse_context ctx;
+    struct minjson_stream *stream;
+
+    if (!options) {
+        default_options = minjson_parse_options_new();
+        options = &default_options;
+    }
+
+    if (minjson_parse_begin(&ctx, doc_aa, options, 0, 1, error) == -1)
+        return NULL;
+
+    stream = arena_allocator_alloc(ctx.scratch_aa,
+                                   DEFAULT_ALIGNMENT,
+                                   sizeof(struct minjson_stream));
+    if (!stream)
+        goto fail_scratch_allocator;
+    stream->ctx = ctx;
+
+    stream->doc = minjson_new(ctx.doc_aa);
+    if (!stream->doc)
+        goto fail_doc_allocator;
+
+    /* Chunks don't outlive minjson_feed, so strings are always copied and
+     * numbers decoded, zero_copy_strings and lazy_numbers are ignored */
+    parser_init(&stream->parser,
+                ctx.doc_aa,
+                ctx.scratch_aa,
+                minjson_object_index_threshold(options),
+                options->duplicate_keys);
+
+    stream->lexer = lexer_new(ctx.scratch_aa, "", 0);
+    if (!stream->lexer)
+        goto fail_scratch_allocator;
+    stream->lexer->partial = 1;
+
+    stream->error = error;
+    stream->carry = NULL;
+    stream->carry_len = 0;
+    stream->carry_capacity = 0;
+    stream->carry_escape = 0;
+    stream->failed = 0;
+
+    return stream;
+
+fail_doc_allocator:
+    minjson_error_set_allocator(error, ctx.doc_aa);
+    goto fail;
+
+fail_scratch_allocator:
+    minjson_error_set_allocator(error, ctx.scratch_aa);
+fail:
+    minjson_parse_abort(&ctx);
+    return NULL;
+}
+
+/* Hands every whole token of input to the parser, returns like
+ * lexer_next_token once there is none left */
+static int minjson_stream_run(struct minjson_stream *stream,
+                              const char *input,
+                              size_t len)
+{
+    struct minjson_token token;
+    int status;
+
+    stream->lexer->current = input;
+    stream->lexer->end = input + len;
+
+    while ((status = lexer_next_token(stream->lexer, &token, stream->error)) == 1) {
+        if (parser_accept(&stream->parser, &token, stream->error) == -1)
+            return -1;
+    }
+
+    return status;
+}
+
+static int minjson_stream_carry(struct minjson_stream *stream,
+                                const char *bytes,
+                                size_t len)
+{
+    char *carry;
+    size_t capacity;
+
+    if (stream->carry_len + len > stream->carry_capacity) {
+        capacity = stream->carry_capacity ? stream->carry_capacity : STREAM_INITIAL_CARRY;
+        while (capacity < stream->carry_len + len)
+            capacity *= 2;
+
+        carry = arena_allocator_alloc(stream->ctx.scratch_aa, 1, capacity);
+        if (!carry)
+            return -1;
+
+        if (stream->carry_len)
+            memcpy(carry, stream->carry, stream->carry_len);
+        stream->carry = carry;
+        stream->carry_capacity = capacity;
+    }
+
+    memcpy(stream->carry + stream->carry_len, bytes, len);
+    stream->carry_len += len;
+
+    return 0;
+}
+
+/* Sets carry_escape from the backslashes carry ends with, an odd run
+ * leaves the last one unfinished */
+static void minjson_stream_set_escape(struct minjson_stream *stream)
+{
+    size_t i = stream->carry_len;
+
+    while (i > 1 && stream->carry[i - 1] == '\\')
+        --i;
+
+    stream->carry_escape = (stream->carry_len - i) % 2;
+}
+
+/* First byte of [p, end) that ends the string in carry or makes it invalid,
+ * NULL if there is none yet. The escape state carries over to the next call. */
+static const char *minjson_stream_string_end(struct minjson_stream *stream,
+                                             const char *p,
+                                             const char *end)
+{
+    while (p < end) {
+        if (stream->carry_escape) {
+            stream->carry_escape = 0;
+            ++p;
+            continue;
+        }
+
+        p += lexer_scan_string(p, end);
+        if (p == end)
+            break;
+
+        if (*p != '\\')
+            return p;
+
+        stream->carry_escape = 1;
+        ++p;
+    }
+
+    return NULL;
+}
+
+int minjson_feed(struct minjson_stream *stream, const char *chunk, size_t len)
+{
+    const char *p = chunk;
+    const char *end = chunk + len;
+    const char *stop;
+    int status;
+
+    if (stream->failed)
+        return -1;
+
+    if (!len)
+        return 0;
+
+    /* Only the cut token is copied, up to the first byte that may end it,
+     * and lexed again once. Escaped quotes are skipped while scanning. */
+    while (stream->carry_len) {
+        if (stream->carry[0] == '"') {
+            stop = minjson_stream_string_end(stream, p, end);
+        } else {
+            for (stop = p; stop < end && is_scalar_byte(*stop); ++stop)
+                ;
+            if (stop == end)
+                stop = NULL;
+        }
+
+        if (!stop) {
+            if (minjson_stream_carry(stream, p, end - p) == -1)
+                goto fail_allocator;
+            return 0;
+        }
+
+        if (minjson_stream_carry(stream, p, stop + 1 - p) == -1)
+            goto fail_allocator;
+        p = stop + 1;
+
+        status = minjson_stream_run(stream, stream->carry, stream->carry_len);
+        if (status == -1)
+            goto fail;
+
+        if (status == 2) {
+            stream->carry_len = stream->carry + stream->carry_len - stream->lexer->current;
+            memmove(stream->carry, stream->lexer->current, stream->carry_len);
+            minjson_stream_set_escape(stream);
+        } else {
+            stream->carry_len = 0;
+        }
+    }
+
+    status = minjson_stream_run(stream, p, end - p);
+    if (status == -1)
+        goto fail;
+
+    if (status == 2) {
+        if (minjson_stream_carry(stream, stream->lexer->current, end - stream->lexer->current) == -1)
+            goto fail_allocator;
+        minjson_stream_set_escape(stream);
+    }
+
+    return 0;
+
+fail_allocator:
+    minjson_error_set_allocator(stream->error, stream->ctx.scratch_aa);
+fail:
+    stream->failed = 1;
+    return -1;
+}
+
+struct minjson *minjson_finish(struct minjson_stream *stream)
+{
+    /* stream is in scratch, it is gone once the parse ends */
+    struct minjson_parse_context ctx = stream->ctx;
+    struct minjson *doc = stream->doc;
+
+    if (stream->failed)
+        goto fail;
+
+    /* What is left in carry ends at the end of input */
+    stream->lexer->partial = 0;
+    if (minjson_stream_run(stream,
+                           stream->carry ? stream->carry : "",
+                           stream->carry_len) == -1)
+        goto fail;
+
+    if (parser_accept(&stream->parser, NULL, stream->error) == -1)
+        goto fail;
+
+    doc->root = stream->parser.root;
+    doc->footprint = minjson_parse_end(&ctx);
+
+    return doc;
+
+fail:
+    minjson_parse_abort(&ctx);
+    return NULL;
+}
+
+struct minjson_tape *minjson_parse_tape(struct arena_allocator *doc_aa,
+                                        const char *raw_json,
+                                        const struct minjson_parse_options *options,
+                                        struct minjson_error *error)
+{
+    struct minjson_parse_options default_options;
+    struct minjson_parse_context ctx;
+    struct minjson_tape *tape = NULL;
+    struct minjson_parser parser;
+    uint64_t *words;
+    char *strings;
+    size_t input_len;
+
+    if (!options) {
+        default_options = minjson_parse_options_new();
+        options = &default_options;
+    }
+    input_len = strlen(raw_json);
+
+    if (minjson_parse_begin(&ctx, doc_aa, options, input_len, 1, error) == -1)
+        return NULL;
+
+    tape = arena_allocator_alloc(ctx.doc_aa, DEFAULT_ALIGNMENT, sizeof(struct minjson_tape));
+    if (!tape)
+        goto fail_doc_allocator;
+
+    parser_init(&parser,
+                ctx.doc_aa,
+                ctx.scratch_aa,
+                minjson_object_index_threshold(options),
+                options->duplicate_keys);
+    if (parser_tape_init(&parser, input_len) == -1)
+        goto fail_scratch_allocator;
+
+    if (minjson_parse_run(&parser, raw_json, input_len, options, error) == -1)
+        goto fail;
+
+    /* Both were built in scratch, they are copied once their size is known */
+    words = arena_allocator_alloc(ctx.doc_aa,
+                                  DEFAULT_ALIGNMENT,
+                                  parser.tape_len * sizeof(uint64_t));
+    if (!words)
+        goto fail_doc_allocator;
+    memcpy(words, parser.tape, parser.tape_len * sizeof(uint64_t));
+
+    strings = arena_allocator_alloc(ctx.doc_aa, 1, parser.strings_len + 1);
+    if (!strings)
+        goto fail_doc_allocator;
+    memcpy(strings, parser.strings, parser.strings_len);
+
+    tape->aallocator = ctx.doc_aa;
+    tape->words = words;
+    tape->len = parser.tape_len;
+    tape->strings = strings;
+    tape->duplicate_keys = options->duplicate_keys;
+    tape->footprint = minjson_parse_end(&ctx);
+
+    return tape;
+
+fail_doc_allocator:
+    minjson_error_set_allocator(error, ctx.doc_aa);
+    goto fail;
+
+fail_scratch_allocator:
+    minjson_error_set_allocator(error, ctx.scratch_aa);
+fail:
+    minjson_parse_abort(&ctx);
+    return NULL;
+}
+
+size_t minjson_get_footprint(struct minjson *doc)
+{
+    return doc ? doc->footprint : 0;
+}
+
+struct minjson_value *minjson_get(struct minjson *doc, const char *key)
+{
+    struct minjson_value *value;
+
+    if (!doc || doc->root->type != MJ_OBJECT)
+        return NULL;
+
+    value = minjson_object_get(doc->root, key);
+
+    return value;
 }
 
 struct minjson_value *minjson_object_get(struct minjson_value *value,
                                          const char *key)
 {
+    struct minjson_object *object;
     struct minjson_object_entry *entry;
+    size_t key_len;
+    size_t slot;
+    size_t i;
+    uint32_t hash;
 
     if (!value || !key || !minjson_value_is_object(value))
         return NULL;
-    
-    entry = value->value.object->head;
-    for (; entry; entry = entry->next)
-        if (strcmp(key, entry->key) == 0)
-            return entry->value;
+
+    object = value->value.object;
+    key_len = strlen(key);
+    if (object->index) {
+        hash = minjson_hash_key(key, key_len);
+        for (slot = hash & object->index_mask;
+             object->index[slot].entry;
+             slot = (slot + 1) & object->index_mask) {
+            entry = &object->entries[object->index[slot].entry - 1];
+            if (object->index[slot].hash == hash && minjson_key_equal(key, key_len, entry))
+                return entry->value;
+        }
+        return NULL;
+    }
+
+    for (i = 0; i < object->len; ++i)
+        if (minjson_key_equal(key, key_len, &object->entries[i]))
+            return object->entries[i].value;
  
     return NULL;
 }
@@ -1169,8 +3205,6 @@ struct minjson_value *minjson_array_get(struct minjson_value *value,
                                         size_t index)
 {
     struct minjson_array *array;
-    struct minjson_array_entry *entry;
-    size_t i;
 
     if (!value || !minjson_value_is_array(value))
         return NULL;
@@ -1179,11 +3213,7 @@ struct minjson_value *minjson_array_get(struct minjson_value *value,
     if (index >= array->len)
         return NULL;
 
-    entry = array->head;
-    for (i = 0; entry && i != index; ++i)
-        entry = entry->next;
-
-    return entry ? entry->value : NULL;
+    return array->values[index];
 }
 
 size_t minjson_array_get_size(struct minjson_value* value)
@@ -1199,13 +3229,155 @@ int minjson_value_is_null(struct minjson_value *value)
     return (value && value->type == MJ_NULL);
 }
 
+/* Conversions between the number types, out of range values saturate */
+static double minjson_number_get_double(enum minjson_number_type type,
+                                        union minjson_number number)
+{
+    switch (type) {
+        case MJ_NUMBER_INT64:
+            return (double)number.int64;
+        case MJ_NUMBER_UINT64:
+            return (double)number.uint64;
+        default:
+            return number.real;
+    }
+}
+
+static int64_t minjson_number_get_int64(enum minjson_number_type type,
+                                        union minjson_number number)
+{
+    switch (type) {
+        case MJ_NUMBER_INT64:
+            return number.int64;
+        case MJ_NUMBER_UINT64:
+            return INT64_MAX;
+        default:
+            /* 2^63 is exact as a double, INT64_MAX is not */
+            if (number.real >= 9223372036854775808.0)
+                return INT64_MAX;
+            if (number.real <= -9223372036854775808.0)
+                return INT64_MIN;
+            return (int64_t)number.real;
+    }
+}
+
+static uint64_t minjson_number_get_uint64(enum minjson_number_type type,
+                                          union minjson_number number)
+{
+    switch (type) {
+        case MJ_NUMBER_INT64:
+            return number.int64 < 0 ? 0 : (uint64_t)number.int64;
+        case MJ_NUMBER_UINT64:
+            return number.uint64;
+        default:
+            if (number.real >= 18446744073709551616.0)
+                return UINT64_MAX;
+            if (number.real <= 0)
+                return 0;
+            return (uint64_t)number.real;
+    }
+}
+
+/* Type of the number in value, stored in number. Lazy ones are decoded and
+ * cached by the first call. */
+static enum minjson_number_type minjson_value_number(struct minjson_value *value,
+                                                     union minjson_number *number)
+{
+    struct minjson_lazy_number *lazy;
+    enum minjson_number_type type;
+#if MINJSON_HAVE_ATOMICS
+    int state;
+    int expected = MJ_NUMBER_LAZY;
+#endif
+
+    if (value->number_type != MJ_NUMBER_LAZY) {
+        *number = value->value.number;
+        return value->number_type;
+    }
+
+    lazy = (struct minjson_lazy_number *)value;
+#if MINJSON_HAVE_ATOMICS
+    state = atomic_load_explicit(&lazy->decoded, memory_order_acquire);
+    if (state != MJ_NUMBER_LAZY && state != MJ_NUMBER_DECODING) {
+        *number = value->value.number;
+        return (enum minjson_number_type)state;
+    }
+
+    /* Only the thread that claims the cache writes it, the others keep
+     * their own decoding */
+    number_parse(lazy->lexeme, lazy->lexeme + lazy->len, 1, &type, number);
+    if (atomic_compare_exchange_strong_explicit(&lazy->decoded,
+                                                &expected,
+                                                MJ_NUMBER_DECODING,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        value->value.number = *number;
+        atomic_store_explicit(&lazy->decoded, type, memory_order_release);
+    }
+#else
+    if (lazy->decoded == MJ_NUMBER_LAZY)
+        number_parse(lazy->lexeme,
+                     lazy->lexeme + lazy->len,
+                     1,
+                     &lazy->decoded,
+                     &value->value.number);
+    type = lazy->decoded;
+    *number = value->value.number;
+#endif
+
+    return type;
+}
+
 int minjson_value_is_number(struct minjson_value *value)
 {
     return (value && value->type == MJ_NUMBER);
 }
 double minjson_value_get_number(struct minjson_value *value)
 {
-    return value->value.number;
+    return minjson_value_get_double(value);
+}
+
+const char *minjson_value_get_number_raw(struct minjson_value *value, size_t *len)
+{
+    struct minjson_lazy_number *lazy;
+
+    if (!minjson_value_is_number(value) || value->number_type != MJ_NUMBER_LAZY)
+        return NULL;
+
+    lazy = (struct minjson_lazy_number *)value;
+    if (len)
+        *len = lazy->len;
+
+    return lazy->lexeme;
+}
+
+int minjson_value_is_int(struct minjson_value *value)
+{
+    union minjson_number number;
+
+    return minjson_value_is_number(value) &&
+           minjson_value_number(value, &number) != MJ_NUMBER_DOUBLE;
+}
+int64_t minjson_value_get_int64(struct minjson_value *value)
+{
+    union minjson_number number;
+    enum minjson_number_type type = minjson_value_number(value, &number);
+
+    return minjson_number_get_int64(type, number);
+}
+uint64_t minjson_value_get_uint64(struct minjson_value *value)
+{
+    union minjson_number number;
+    enum minjson_number_type type = minjson_value_number(value, &number);
+
+    return minjson_number_get_uint64(type, number);
+}
+double minjson_value_get_double(struct minjson_value *value)
+{
+    union minjson_number number;
+    enum minjson_number_type type = minjson_value_number(value, &number);
+
+    return minjson_number_get_double(type, number);
 }
 
 int minjson_value_is_string(struct minjson_value *value)
@@ -1214,7 +3386,11 @@ int minjson_value_is_string(struct minjson_value *value)
 }
 char *minjson_value_get_string(struct minjson_value *value)
 {
-    return value->value.string;
+    return (char *)value->value.string;
+}
+size_t minjson_value_get_string_len(struct minjson_value *value)
+{
+    return ((struct minjson_string *)value)->len;
 }
 
 int minjson_value_is_bool(struct minjson_value *value)
@@ -1243,3 +3419,211 @@ struct minjson_object *minjson_value_get_object(struct minjson_value *value)
 {
     return value->value.object;
 }
+
+/* ================== Tape ================== */
+
+static struct minjson_tape_value minjson_tape_value_at(const struct minjson_tape *tape,
+                                                       size_t index)
+{
+    struct minjson_tape_value value;
+    value.tape = tape;
+    value.index = index;
+
+    return value;
+}
+
+/* Tag of the word value points at, TAPE_CLOSE for a value that wasn't found */
+static unsigned int minjson_tape_value_tag(struct minjson_tape_value value)
+{
+    return value.tape ? TAPE_TAG(value.tape->words[value.index]) : TAPE_CLOSE;
+}
+
+/* Index of the word right after the value at index, subtree included */
+static size_t minjson_tape_skip(const uint64_t *words, size_t index)
+{
+    switch (TAPE_TAG(words[index])) {
+        case MJ_OBJECT:
+        case MJ_ARRAY:
+            return TAPE_PAYLOAD(words[index]) + 1;
+        case MJ_NUMBER:
+            return index + 2;
+        default:
+            return index + 1;
+    }
+}
+
+size_t minjson_tape_get_footprint(struct minjson_tape *tape)
+{
+    return tape ? tape->footprint : 0;
+}
+
+struct minjson_tape_value minjson_tape_root(struct minjson_tape *tape)
+{
+    return minjson_tape_value_at(tape, 0);
+}
+
+struct minjson_tape_value minjson_tape_get(struct minjson_tape *tape, const char *key)
+{
+    return minjson_tape_object_get(minjson_tape_root(tape), key);
+}
+
+struct minjson_tape_value minjson_tape_object_get(struct minjson_tape_value value,
+                                                  const char *key)
+{
+    const uint64_t *words;
+    size_t found = 0;
+    size_t i;
+
+    if (!key || minjson_tape_value_tag(value) != MJ_OBJECT)
+        return minjson_tape_value_at(NULL, 0);
+
+    /* Every entry is on the tape whatever the duplicate policy, the last
+     * one found wins only when asked to */
+    words = value.tape->words;
+    for (i = value.index + 2; TAPE_TAG(words[i]) != TAPE_CLOSE; i = minjson_tape_skip(words, i + 1)) {
+        if (strcmp(key, value.tape->strings + TAPE_PAYLOAD(words[i])) == 0) {
+            found = i + 1;
+            if (value.tape->duplicate_keys != MJ_DUPLICATE_LAST_WINS)
+                break;
+        }
+    }
+
+    return minjson_tape_value_at(found ? value.tape : NULL, found);
+}
+
+struct minjson_tape_value minjson_tape_array_get(struct minjson_tape_value value,
+                                                 size_t index)
+{
+    const uint64_t *words;
+    size_t i;
+
+    if (minjson_tape_value_tag(value) != MJ_ARRAY ||
+        index >= value.tape->words[value.index + 1])
+        return minjson_tape_value_at(NULL, 0);
+
+    words = value.tape->words;
+    for (i = value.index + 2; index; --index)
+        i = minjson_tape_skip(words, i);
+
+    return minjson_tape_value_at(value.tape, i);
+}
+
+size_t minjson_tape_array_get_size(struct minjson_tape_value value)
+{
+    ASSERT(minjson_tape_value_is_array(value));
+
+    return value.tape->words[value.index + 1];
+}
+
+struct minjson_tape_value minjson_tape_value_first(struct minjson_tape_value value)
+{
+    unsigned int tag = minjson_tape_value_tag(value);
+
+    if ((tag != MJ_OBJECT && tag != MJ_ARRAY) ||
+        TAPE_TAG(value.tape->words[value.index + 2]) == TAPE_CLOSE)
+        return minjson_tape_value_at(NULL, 0);
+
+    return minjson_tape_value_at(value.tape, value.index + 2);
+}
+
+struct minjson_tape_value minjson_tape_value_next(struct minjson_tape_value value)
+{
+    size_t next;
+
+    if (!value.tape)
+        return value;
+
+    next = minjson_tape_skip(value.tape->words, value.index);
+    if (next >= value.tape->len || TAPE_TAG(value.tape->words[next]) == TAPE_CLOSE)
+        return minjson_tape_value_at(NULL, 0);
+
+    return minjson_tape_value_at(value.tape, next);
+}
+
+int minjson_tape_value_exists(struct minjson_tape_value value)
+{
+    return value.tape != NULL;
+}
+
+int minjson_tape_value_is_null(struct minjson_tape_value value)
+{
+    return minjson_tape_value_tag(value) == MJ_NULL;
+}
+
+int minjson_tape_value_is_number(struct minjson_tape_value value)
+{
+    return minjson_tape_value_tag(value) == MJ_NUMBER;
+}
+double minjson_tape_value_get_number(struct minjson_tape_value value)
+{
+    return minjson_tape_value_get_double(value);
+}
+
+static enum minjson_number_type minjson_tape_number(struct minjson_tape_value value,
+                                                    union minjson_number *number)
+{
+    ASSERT(minjson_tape_value_is_number(value));
+
+    memcpy(number, &value.tape->words[value.index + 1], sizeof(*number));
+
+    return (enum minjson_number_type)TAPE_PAYLOAD(value.tape->words[value.index]);
+}
+
+int minjson_tape_value_is_int(struct minjson_tape_value value)
+{
+    return minjson_tape_value_is_number(value) &&
+           TAPE_PAYLOAD(value.tape->words[value.index]) != MJ_NUMBER_DOUBLE;
+}
+int64_t minjson_tape_value_get_int64(struct minjson_tape_value value)
+{
+    union minjson_number number;
+    enum minjson_number_type type = minjson_tape_number(value, &number);
+
+    return minjson_number_get_int64(type, number);
+}
+uint64_t minjson_tape_value_get_uint64(struct minjson_tape_value value)
+{
+    union minjson_number number;
+    enum minjson_number_type type = minjson_tape_number(value, &number);
+
+    return minjson_number_get_uint64(type, number);
+}
+double minjson_tape_value_get_double(struct minjson_tape_value value)
+{
+    union minjson_number number;
+    enum minjson_number_type type = minjson_tape_number(value, &number);
+
+    return minjson_number_get_double(type, number);
+}
+
+int minjson_tape_value_is_string(struct minjson_tape_value value)
+{
+    return minjson_tape_value_tag(value) == MJ_STRING;
+}
+const char *minjson_tape_value_get_string(struct minjson_tape_value value)
+{
+    ASSERT(minjson_tape_value_is_string(value));
+
+    return value.tape->strings + TAPE_PAYLOAD(value.tape->words[value.index]);
+}
+
+int minjson_tape_value_is_bool(struct minjson_tape_value value)
+{
+    unsigned int tag = minjson_tape_value_tag(value);
+
+    return tag == MJ_TRUE || tag == MJ_FALSE;
+}
+int minjson_tape_value_get_bool(struct minjson_tape_value value)
+{
+    return minjson_tape_value_tag(value) == MJ_TRUE;
+}
+
+int minjson_tape_value_is_array(struct minjson_tape_value value)
+{
+    return minjson_tape_value_tag(value) == MJ_ARRAY;
+}
+
+int minjson_tape_value_is_object(struct minjson_tape_value value)
+{
+    return minjson_tape_value_tag(value) == MJ_OBJECT;
+}
@@ -12,18 +12,51 @@
 
 #endif
 
+#include <stdint.h>
+
 #include "arena.h"
 
+#define MINJSON_OBJECT_INDEX_THRESHOLD 16
+
+
+/* What minjson_parse_ex does with a key found twice in the same object */
+enum minjson_duplicate_policy {
+    MJ_DUPLICATE_REJECT,        /* Fails the parse, the default */
+    MJ_DUPLICATE_FIRST_WINS,    /* Keeps the first value */
+    MJ_DUPLICATE_LAST_WINS,     /* Keeps the last value, where the first key was */
+    MJ_DUPLICATE_NO_CHECK       /* Keeps every entry without looking for
+                                   duplicates, minjson_object_get finds the first */
+};
 
 struct minjson_lexer;
+struct minjson_stream;
 struct minjson {
     struct arena_allocator *aallocator;
     struct minjson_value *root;
+    size_t footprint; /* Bytes of aallocator taken by this document */
 };
 struct minjson_value;
 struct minjson_object;
 struct minjson_array;
 
+/* A whole document flattened in a single array of 64 bits words, see
+ * minjson_parse_tape. Strings are kept apart in strings. */
+struct minjson_tape {
+    struct arena_allocator *aallocator;
+    const uint64_t *words;
+    size_t len;
+    const char *strings;
+    enum minjson_duplicate_policy duplicate_keys;
+    size_t footprint; /* Bytes of aallocator taken by this document */
+};
+
+/* A value inside a minjson_tape, small enough to pass around by value.
+ * Lookups that find nothing return one with a NULL tape. */
+struct minjson_tape_value {
+    const struct minjson_tape *tape;
+    size_t index;
+};
+
 enum minjson_error_code {
     MJ_CODE_OK,
     MJ_ERR_ALLOCATOR,
@@ -33,7 +66,8 @@ enum minjson_error_code {
     MJ_ERR_NUMBER,
     MJ_ERR_OBJECT,
     MJ_ERR_ARRAY,
-    MJ_ERR_VALUE
+    MJ_ERR_VALUE,
+    MJ_ERR_FILE
 };
 struct minjson_error {
     enum minjson_error_code code;
@@ -41,6 +75,43 @@ struct minjson_error {
     size_t line, column;
 };
 
+/* Tweaks for minjson_parse_ex, start from minjson_parse_options_new() */
+struct minjson_parse_options {
+    /* Initial size of the document arena when minjson_parse_ex creates it.
+     * 0 derives it from the input length, up to DEFAULT_ARENA_MAX_CHUNK_SIZE.
+     * Ignored if doc_aa is given. */
+    size_t doc_arena_size;
+    /* Initial size of the lexer/parser scratch arena, 0 for DEFAULT_ARENA_SIZE */
+    size_t scratch_arena_size;
+    /* Scratch arena owned by the caller, used instead of creating one on each
+     * parse. Everything the parse allocates in it is rolled back once parsing
+     * is done. Ignores scratch_arena_size. May be doc_aa itself, scratch then
+     * stays in doc_aa next to the document, so a whole parse can run out of
+     * a single arena_allocator_new_static buffer without ever calling malloc. */
+    struct arena_allocator *scratch_aa;
+    /* Backend of the arenas minjson_parse_ex creates itself, NULL for
+     * arena_backend_malloc. With arena_backend_pool, parsing small documents
+     * on many threads takes its memory from the pool instead of malloc. */
+    const struct arena_backend *backend;
+    void *backend_user;
+    /* Objects with at least this many keys get a hash index built while
+     * parsing, smaller ones are scanned. 0 for MINJSON_OBJECT_INDEX_THRESHOLD,
+     * (size_t)-1 to never build one. */
+    size_t object_index_threshold;
+    enum minjson_duplicate_policy duplicate_keys;
+    /* Non zero only validates numbers, each one keeps where it sits in
+     * raw_json and is decoded on its first read, then cached. raw_json must
+     * then outlive the document, unchanged. The first read of a number
+     * writes to the document, safely with C11 atomics, otherwise lock around
+     * reads shared between threads. Ignored by minjson_parse_tape. */
+    int lazy_numbers;
+    /* Non zero lets strings and keys without escape sequences point in
+     * raw_json instead of being copied. raw_json must then outlive the
+     * document, unchanged, and those strings are NOT null terminated, use
+     * minjson_value_get_string_len. Ignored by minjson_parse_tape. */
+    int zero_copy_strings;
+};
+
 /**
  * @brief   Creates a new minjson_lexer.
  *
@@ -81,10 +152,12 @@ void minjson_lexer_print_tokens(struct minjson_lexer *lexer);
  * @brief   Performs the whole parsing operation on the given raw_json.
  *
  * The whole parsing operation includes creating lexer, doing lexical analysis,
- * and doing parsing itself.
+ * and doing parsing itself. Both are done in a single pass, the parser pulls
+ * one token at a time from the lexer so no token stream is ever built.
  *
  * @param   doc_aa      The arena allocator where the result will live. If NULL,
  *                      it will be created and referenced by minjson aallocator member.
+ *                      On failure, whatever was allocated in it is rolled back.
  * @param   raw_json    Raw JSON string (must be null terminated).
  * @param   error       Holds information if an error occured. Belongs to the caller.
  *
@@ -96,11 +169,148 @@ struct minjson *minjson_parse(struct arena_allocator *doc_aa,
                               const char *raw_json,
                               struct minjson_error *error);
 
+/**
+ * @brief   Same as minjson_parse but with minjson_parse_options.
+ *
+ * Sizing the arenas close to what the document needs up front saves the
+ * allocations and arena chaining done while a large document is parsed.
+ *
+ * @param   options     Parse options, NULL uses minjson_parse_options_new().
+ */
+struct minjson *minjson_parse_ex(struct arena_allocator *doc_aa,
+                                 const char *raw_json,
+                                 const struct minjson_parse_options *options,
+                                 struct minjson_error *error);
+
+/**
+ * @brief   Same as minjson_parse but raw_json is len bytes long, no null
+ *          terminator needed.
+ *
+ * The lexer never reads past raw_json + len, so network buffers and mapped
+ * files can be parsed as they are. A nul byte within len is an error.
+ */
+struct minjson *minjson_parse_n(struct arena_allocator *doc_aa,
+                                const char *raw_json,
+                                size_t len,
+                                struct minjson_error *error);
+
+/* Same as minjson_parse_n but with minjson_parse_options */
+struct minjson *minjson_parse_n_ex(struct arena_allocator *doc_aa,
+                                   const char *raw_json,
+                                   size_t len,
+                                   const struct minjson_parse_options *options,
+                                   struct minjson_error *error);
+
+#if ARENA_HAVE_MMAP
+/**
+ * @brief   Parses the file at path without reading it in a heap copy.
+ *
+ * The file is mapped read only and parsed with minjson_parse_n_ex. The
+ * mapping lives as long as the document, so strings parsed with
+ * zero_copy_strings and lazy numbers can point in it. Destroying
+ * aallocator unmaps it. The document arena is always created, with the
+ * backend of options if any.
+ *
+ * @param   options     Parse options, NULL uses minjson_parse_options_new().
+ *
+ * @return  NULL on failure, MJ_ERR_FILE if the file couldn't be mapped.
+ */
+struct minjson *minjson_parse_file(const char *path,
+                                   const struct minjson_parse_options *options,
+                                   struct minjson_error *error);
+#endif
+
+/**
+ * @brief   Same as minjson_parse_ex but decodes strings inside raw_json.
+ *
+ * Strings and keys are unescaped in place, which never makes them longer,
+ * and null terminated over their closing quote. The document points in
+ * raw_json for all of them so string data takes no arena memory at all.
+ * raw_json must outlive the document and is left mangled, even by a failed
+ * parse. zero_copy_strings has no effect, strings are always null terminated.
+ */
+struct minjson *minjson_parse_insitu(struct arena_allocator *doc_aa,
+                                     char *raw_json,
+                                     const struct minjson_parse_options *options,
+                                     struct minjson_error *error);
+
+/**
+ * @brief   Starts a parse of input that comes in chunks, e.g. off a socket.
+ *
+ * Feed the chunks in order with minjson_feed, then get the document with
+ * minjson_finish. Chunks may be cut anywhere, even inside a token, and are
+ * not needed once minjson_feed returns. The document and the errors are
+ * the same as minjson_parse_n_ex on the whole input, except that strings
+ * are always copied and numbers decoded: zero_copy_strings and
+ * lazy_numbers are ignored.
+ *
+ * @param   doc_aa      Arena of the document, NULL creates one.
+ * @param   options     Parse options, NULL uses minjson_parse_options_new().
+ * @param   error       Filled by minjson_feed and minjson_finish as well,
+ *                      must outlive the stream.
+ *
+ * @return  NULL if allocation failed.
+ */
+struct minjson_stream *minjson_stream_new(struct arena_allocator *doc_aa,
+                                          const struct minjson_parse_options *options,
+                                          struct minjson_error *error);
+
+/**
+ * @brief   Lexes and parses as much of chunk as it can.
+ *
+ * A token cut by the end of chunk is copied aside until the next chunk
+ * completes it.
+ *
+ * @return  0 on success, -1 on error. Once it fails every call fails, the
+ *          stream must still be released with minjson_finish.
+ */
+int minjson_feed(struct minjson_stream *stream, const char *chunk, size_t len);
+
+/**
+ * @brief   Ends the input and releases stream.
+ *
+ * @return  The document, NULL if the input was invalid or incomplete or a
+ *          minjson_feed failed.
+ */
+struct minjson *minjson_finish(struct minjson_stream *stream);
+
+/**
+ * @brief   Same as minjson_parse_ex but lays the document out as a tape.
+ *
+ * Instead of a value per allocation linked by pointers, the whole document is
+ * one array of 64 bits words: a tag and a payload per value, objects and
+ * arrays hold the index of their closing word so a subtree is skipped in one
+ * jump. Strings sit back to back in a side buffer. Takes two to three times less
+ * memory than the minjson_value DOM and walks it in order, but lookups are
+ * linear scans, object_index_threshold is ignored. Duplicate keys that are not
+ * rejected all stay on the tape, lookups honor the policy.
+ *
+ * Read it with the minjson_tape_* accessors below. To destroy it, destroy
+ * the aallocator with arena_allocator_destroy.
+ */
+struct minjson_tape *minjson_parse_tape(struct arena_allocator *doc_aa,
+                                        const char *raw_json,
+                                        const struct minjson_parse_options *options,
+                                        struct minjson_error *error);
+
+/**
+ * @brief   Creates a new minjson_parse_options struct with default values.
+ */
+struct minjson_parse_options minjson_parse_options_new(void);
+
 /**
  * @brief   Creates a new minjson_error struct.
  */
 struct minjson_error minjson_error_new(void);
 
+/**
+ * @brief   Returns how many bytes of its arena allocator the document takes.
+ *
+ * Counts what the parse allocated, alignment padding included. Use
+ * arena_allocator_get_stats on doc->aallocator for the memory reserved.
+ */
+size_t minjson_get_footprint(struct minjson *doc);
+
 /**
  * @brief   A wrapper to minjson_object_get.
  *
@@ -113,7 +323,9 @@ struct minjson_value *minjson_get(struct minjson *doc, const char *key);
  * @brief   Retrieve a value from a JSON object by key.
  *
  * Searches the given JSON object (as value for convinience) for a key that
- * matches the given string and return its associated value.
+ * matches the given string and return its associated value. Constant time on
+ * average for objects that got a hash index (see object_index_threshold in
+ * minjson_parse_options), a linear scan otherwise.
  *
  * @param   value   A minjson_value of type object.
  * @param   key     A null terminated string.
@@ -142,10 +354,43 @@ size_t minjson_array_get_size(struct minjson_value *value);
 int minjson_value_is_null(struct minjson_value *value);
 
 int minjson_value_is_number(struct minjson_value *value);
+/* Same as minjson_value_get_double */
 double minjson_value_get_number(struct minjson_value *value);
 
+/**
+ * @brief   The number exactly as it was written in raw_json.
+ *
+ * Lets numbers be forwarded without going through a double and back.
+ *
+ * @param   len     Where the length of the text is stored, may be NULL.
+ *
+ * @return  A pointer inside raw_json, not null terminated. NULL unless the
+ *          document was parsed with lazy_numbers.
+ */
+const char *minjson_value_get_number_raw(struct minjson_value *value, size_t *len);
+
+/**
+ * @brief   Tells whether a number was an integer that fits in 64 bits.
+ *
+ * Such integers (no fraction, no exponent, from INT64_MIN to UINT64_MAX) are
+ * kept exact, IDs and timestamps above 2^53 included. Every other number is
+ * a double.
+ */
+int minjson_value_is_int(struct minjson_value *value);
+/* Integers above INT64_MAX saturate, use minjson_value_get_uint64 for them.
+ * Doubles are truncated toward zero and saturate as well. */
+int64_t minjson_value_get_int64(struct minjson_value *value);
+/* Negative numbers give 0, doubles are truncated and saturate */
+uint64_t minjson_value_get_uint64(struct minjson_value *value);
+/* Nearest double for integers */
+double minjson_value_get_double(struct minjson_value *value);
+
 int minjson_value_is_string(struct minjson_value *value);
+/* Null terminated unless parsed with zero_copy_strings, except by
+ * minjson_parse_insitu */
 char *minjson_value_get_string(struct minjson_value *value);
+/* In bytes, a decoded \u0000 included */
+size_t minjson_value_get_string_len(struct minjson_value *value);
 
 int minjson_value_is_bool(struct minjson_value *value);
 int minjson_value_get_bool(struct minjson_value *value);
@@ -156,4 +401,46 @@ struct minjson_array *minjson_value_get_array(struct minjson_value *value);
 int minjson_value_is_object(struct minjson_value *value);
 struct minjson_object *minjson_value_get_object(struct minjson_value *value);
 
+/* Tape counterparts of the accessors above, they take and return handles */
+size_t minjson_tape_get_footprint(struct minjson_tape *tape);
+
+struct minjson_tape_value minjson_tape_root(struct minjson_tape *tape);
+struct minjson_tape_value minjson_tape_get(struct minjson_tape *tape, const char *key);
+struct minjson_tape_value minjson_tape_object_get(struct minjson_tape_value value,
+                                                  const char *key);
+/* Walks index elements, iterate with minjson_tape_value_next instead */
+struct minjson_tape_value minjson_tape_array_get(struct minjson_tape_value value,
+                                                 size_t index);
+size_t minjson_tape_array_get_size(struct minjson_tape_value value);
+
+/**
+ * @brief   First child of an object or array, use minjson_tape_value_next to
+ *          go through the others.
+ *
+ * An object yields its key then its value, for each entry.
+ */
+struct minjson_tape_value minjson_tape_value_first(struct minjson_tape_value value);
+struct minjson_tape_value minjson_tape_value_next(struct minjson_tape_value value);
+
+int minjson_tape_value_exists(struct minjson_tape_value value);
+
+int minjson_tape_value_is_null(struct minjson_tape_value value);
+
+int minjson_tape_value_is_number(struct minjson_tape_value value);
+double minjson_tape_value_get_number(struct minjson_tape_value value);
+int minjson_tape_value_is_int(struct minjson_tape_value value);
+int64_t minjson_tape_value_get_int64(struct minjson_tape_value value);
+uint64_t minjson_tape_value_get_uint64(struct minjson_tape_value value);
+double minjson_tape_value_get_double(struct minjson_tape_value value);
+
+int minjson_tape_value_is_string(struct minjson_tape_value value);
+const char *minjson_tape_value_get_string(struct minjson_tape_value value);
+
+int minjson_tape_value_is_bool(struct minjson_tape_value value);
+int minjson_tape_value_get_bool(struct minjson_tape_value value);
+
+int minjson_tape_value_is_array(struct minjson_tape_value value);
+
+int minjson_tape_value_is_object(struct minjson_tape_value value);
+
 #endif
@@ -1,65 +1,627 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string.h>
 
-char *read_from_file(char *path)
+#include "arena.h"
+#include "minjson.h"
+
+#if !ARENA_HAVE_MMAP
+/* Reads the whole file at path in a malloc'd buffer, NULL on failure */
+static char *read_from_file(const char *path, size_t *len)
+{
+    char *buffer = NULL;
+    long size;
+    FILE *fp = fopen(path, "rb");
+
+    if (!fp)
+        return NULL;
+
+    if (fseek(fp, 0L, SEEK_END) == 0 && (size = ftell(fp)) >= 0 &&
+        fseek(fp, 0L, SEEK_SET) == 0) {
+        buffer = malloc(size ? size : 1);
+        if (buffer) {
+            *len = fread(buffer, 1, size, fp);
+            if (ferror(fp)) {
+                free(buffer);
+                buffer = NULL;
+            }
+        }
+    }
+    fclose(fp);
+
+    return buffer;
+}
+#endif
+
+/* A long string full of escaped quotes, fed to the push parser in small
+ * chunks, must be scanned once and not again from its start every chunk */
+static int check_stream_escaped_string(void)
+{
+    struct minjson_error error;
+    struct minjson_stream *stream;
+    struct minjson *doc;
+    size_t len = 4 << 20;
+    size_t chunk = 4096;
+    size_t escapes = 0;
+    size_t i;
+    char *json;
+    int ok;
+
+    json = malloc(len);
+    if (!json)
+        return -1;
+
+    json[0] = '[';
+    json[1] = '"';
+    for (i = 2; i < len - 2; ++i) {
+        json[i] = i % 10 == 8 ? '\\' : i % 10 == 9 ? '"' : 'a';
+        escapes += json[i] == '\\';
+    }
+    json[len - 2] = '"';
+    json[len - 1] = ']';
+
+    error = minjson_error_new();
+    stream = minjson_stream_new(NULL, NULL, &error);
+    if (!stream) {
+        free(json);
+        return -1;
+    }
+
+    for (i = 0; i < len; i += chunk)
+        minjson_feed(stream, json + i, len - i < chunk ? len - i : chunk);
+
+    doc = minjson_finish(stream);
+    free(json);
+    if (!doc) {
+        fprintf(stderr, "Error: %s\n", error.message);
+        return -1;
+    }
+
+    /* Every \" decodes to a single " */
+    ok = minjson_value_get_string_len(minjson_array_get(doc->root, 0)) == len - 4 - escapes;
+    arena_allocator_destroy(doc->aallocator);
+
+    return ok ? 0 : -1;
+}
+
+/* Parses number alone in an array, NULL if the parse failed */
+static struct minjson *parse_number(const char *number, struct minjson_value **value)
+{
+    struct minjson_error error;
+    struct minjson *doc;
+    char json[128];
+
+    sprintf(json, "[%s]", number);
+    error = minjson_error_new();
+    doc = minjson_parse(NULL, json, &error);
+    if (!doc)
+        return NULL;
+
+    *value = minjson_array_get(doc->root, 0);
+
+    return doc;
+}
+
+/* Every double must come out bit for bit as strtod rounds it, halfway cases
+ * and numbers past the fast paths included */
+static int check_numbers_against_strtod(void)
+{
+    static const char *numbers[] = {
+        "0", "-0", "-0.0", "0.1", "0.3", "1e23", "8.98846567431158e307",
+        "1.7976931348623157e308", "2.2250738585072011e-308",
+        "2.2250738585072014e-308", "4.9406564584124654e-324",
+        "2.4703282292062328e-324", "2.4703282292062327e-324", "1e-400",
+        /* Halfway between two doubles, ties go to even */
+        "9007199254740993.0", "9007199254740995.0", "1.00000000000000011102230246251565404236316680908203125",
+        "1.00000000000000011102230246251565404236316680908203126",
+        "9007199254740992.5e0", "4503599627370496.5", "4503599627370497.5",
+        /* More digits than a uint64_t holds */
+        "123456789012345678901234567890", "0.123456789012345678901234567890",
+        "7.2057594037927933e16", "3.0517578125e-05", "-1.5e-10", "12345678.9e-3"
+    };
+    struct minjson_value *value;
+    struct minjson *doc;
+    double expected, got;
+    uint64_t seed = 42;
+    char number[64];
+    size_t i;
+
+    for (i = 0; i < sizeof(numbers) / sizeof(numbers[0]) + 10000; ++i) {
+        if (i < sizeof(numbers) / sizeof(numbers[0])) {
+            strcpy(number, numbers[i]);
+        } else {
+            /* Random significands of up to 19 digits, random exponents */
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            sprintf(number, "%lu.%lue%d",
+                    (unsigned long)(seed >> 44),
+                    (unsigned long)((seed >> 8) & 0xfffff),
+                    (int)(seed % 600) - 300);
+        }
+
+        doc = parse_number(number, &value);
+        if (!doc) {
+            fprintf(stderr, "Error: %s did not parse\n", number);
+            return -1;
+        }
+        expected = strtod(number, NULL);
+        got = minjson_value_get_double(value);
+        arena_allocator_destroy(doc->aallocator);
+
+        if (memcmp(&expected, &got, sizeof(got)) != 0) {
+            fprintf(stderr, "Error: %s parsed as %.17g, strtod gives %.17g\n",
+                    number, got, expected);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Integers from INT64_MIN to UINT64_MAX stay exact, one past them is a double */
+static int check_integer_limits(void)
 {
-    /* Code for reading a file from stack overflow */
+    struct minjson_value *value;
+    struct minjson *doc;
+    int ok = 1;
+
+    doc = parse_number("9223372036854775807", &value);
+    ok = ok && doc && minjson_value_is_int(value) && minjson_value_get_int64(value) == INT64_MAX;
+    if (doc)
+        arena_allocator_destroy(doc->aallocator);
 
-    char *result = NULL;
-    FILE *fp = fopen(path, "r");
-    if (fp != NULL) {
-        /* Go to the end of the file. */
-        if (fseek(fp, 0L, SEEK_END) == 0) {
-            /* Get the size of the file. */
-            size_t new_len;
-            long bufsize = ftell(fp);
+    doc = parse_number("-9223372036854775808", &value);
+    ok = ok && doc && minjson_value_is_int(value) && minjson_value_get_int64(value) == INT64_MIN &&
+         minjson_value_get_uint64(value) == 0;
+    if (doc)
+        arena_allocator_destroy(doc->aallocator);
 
-            if (bufsize == -1) { /* Error */ }
+    /* Above INT64_MAX, int64 saturates */
+    doc = parse_number("9223372036854775808", &value);
+    ok = ok && doc && minjson_value_is_int(value) &&
+         minjson_value_get_uint64(value) == (uint64_t)1 << 63 &&
+         minjson_value_get_int64(value) == INT64_MAX;
+    if (doc)
+        arena_allocator_destroy(doc->aallocator);
 
-            /* Allocate our buffer to that size. */
-            result = malloc(bufsize + 1);
+    doc = parse_number("18446744073709551615", &value);
+    ok = ok && doc && minjson_value_is_int(value) && minjson_value_get_uint64(value) == UINT64_MAX;
+    if (doc)
+        arena_allocator_destroy(doc->aallocator);
 
-            /* Go back to the start of the file. */
-            if (fseek(fp, 0L, SEEK_SET) != 0) { /* Error */ }
+    doc = parse_number("18446744073709551616", &value);
+    ok = ok && doc && !minjson_value_is_int(value) &&
+         minjson_value_get_double(value) == 18446744073709551616.0;
+    if (doc)
+        arena_allocator_destroy(doc->aallocator);
 
-            /* Read the entire file into memory. */
-            new_len = fread(result, sizeof(char), bufsize, fp);
-            if ( ferror( fp ) != 0 ) {
-                fputs("Error reading file", stderr);
+    doc = parse_number("-9223372036854775809", &value);
+    ok = ok && doc && !minjson_value_is_int(value) &&
+         minjson_value_get_double(value) == -9223372036854775808.0;
+    if (doc)
+        arena_allocator_destroy(doc->aallocator);
+
+    /* 2^53 + 1 has no double but stays exact as an integer */
+    doc = parse_number("9007199254740993", &value);
+    ok = ok && doc && minjson_value_get_int64(value) == INT64_C(9007199254740993) &&
+         minjson_value_get_double(value) == 9007199254740992.0;
+    if (doc)
+        arena_allocator_destroy(doc->aallocator);
+
+    return ok ? 0 : -1;
+}
+
+/* Builds an object of keys k0 to k<n - 1> valued 0 to n - 1, followed by a
+ * second k1 valued 100 */
+static void object_with_duplicate(char *json, size_t n)
+{
+    size_t i;
+
+    json += sprintf(json, "{");
+    for (i = 0; i < n; ++i)
+        json += sprintf(json, "\"k%lu\":%lu,", (unsigned long)i, (unsigned long)i);
+    sprintf(json, "\"k1\":100}");
+}
+
+/* Each policy on a small object, scanned, and on one big enough for the
+ * key set, for the DOM and the tape alike */
+static int check_duplicate_keys(void)
+{
+    static const enum minjson_duplicate_policy policies[] = {
+        MJ_DUPLICATE_REJECT,
+        MJ_DUPLICATE_FIRST_WINS,
+        MJ_DUPLICATE_LAST_WINS,
+        MJ_DUPLICATE_NO_CHECK
+    };
+    struct minjson_parse_options options;
+    struct minjson_error error;
+    struct minjson_tape *tape;
+    struct minjson *doc;
+    int64_t expected;
+    size_t sizes[2] = { 3, 40 };
+    char json[1024];
+    size_t i, j;
+
+    for (i = 0; i < 2; ++i) {
+        object_with_duplicate(json, sizes[i]);
+        for (j = 0; j < sizeof(policies) / sizeof(policies[0]); ++j) {
+            options = minjson_parse_options_new();
+            options.duplicate_keys = policies[j];
+            expected = policies[j] == MJ_DUPLICATE_LAST_WINS ? 100 : 1;
+
+            error = minjson_error_new();
+            doc = minjson_parse_ex(NULL, json, &options, &error);
+            if (policies[j] == MJ_DUPLICATE_REJECT) {
+                if (doc || error.code != MJ_ERR_OBJECT)
+                    return -1;
             } else {
-                result[new_len] = '\0';
+                if (!doc || minjson_value_get_int64(minjson_get(doc, "k1")) != expected)
+                    return -1;
+                arena_allocator_destroy(doc->aallocator);
+            }
+
+            error = minjson_error_new();
+            tape = minjson_parse_tape(NULL, json, &options, &error);
+            if (policies[j] == MJ_DUPLICATE_REJECT) {
+                if (tape || error.code != MJ_ERR_OBJECT)
+                    return -1;
+            } else {
+                if (!tape || minjson_tape_value_get_int64(minjson_tape_get(tape, "k1")) != expected)
+                    return -1;
+                arena_allocator_destroy(tape->aallocator);
             }
         }
-        fclose(fp);
     }
 
-    return result;
+    /* The same key in two different objects is no duplicate */
+    error = minjson_error_new();
+    doc = minjson_parse(NULL, "{\"a\":{\"a\":1,\"b\":2},\"b\":{\"a\":3}}", &error);
+    if (!doc)
+        return -1;
+    arena_allocator_destroy(doc->aallocator);
 
+    return 0;
 }
 
-#include "arena.h"
-#include "minjson.h"
+/* Whether the tape value and the DOM value hold the same JSON */
+static int same_value(struct minjson_tape_value tv, struct minjson_value *value)
+{
+    struct minjson_tape_value child;
+    double a, b;
+    size_t i;
 
-int main(void)
+    if (minjson_tape_value_is_null(tv))
+        return minjson_value_is_null(value);
+
+    if (minjson_tape_value_is_bool(tv))
+        return minjson_value_is_bool(value) &&
+               minjson_tape_value_get_bool(tv) == minjson_value_get_bool(value);
+
+    if (minjson_tape_value_is_number(tv)) {
+        if (!minjson_value_is_number(value) ||
+            minjson_tape_value_is_int(tv) != minjson_value_is_int(value))
+            return 0;
+        a = minjson_tape_value_get_double(tv);
+        b = minjson_value_get_double(value);
+        return memcmp(&a, &b, sizeof(a)) == 0 &&
+               minjson_tape_value_get_int64(tv) == minjson_value_get_int64(value) &&
+               minjson_tape_value_get_uint64(tv) == minjson_value_get_uint64(value);
+    }
+
+    if (minjson_tape_value_is_string(tv))
+        return minjson_value_is_string(value) &&
+               strcmp(minjson_tape_value_get_string(tv), minjson_value_get_string(value)) == 0;
+
+    if (minjson_tape_value_is_array(tv)) {
+        if (!minjson_value_is_array(value) ||
+            minjson_tape_array_get_size(tv) != minjson_array_get_size(value))
+            return 0;
+        child = minjson_tape_value_first(tv);
+        for (i = 0; minjson_tape_value_exists(child); ++i) {
+            if (!same_value(child, minjson_array_get(value, i)))
+                return 0;
+            child = minjson_tape_value_next(child);
+        }
+        return i == minjson_array_get_size(value);
+    }
+
+    if (minjson_tape_value_is_object(tv)) {
+        if (!minjson_value_is_object(value))
+            return 0;
+        /* Keys and values alternate */
+        child = minjson_tape_value_first(tv);
+        while (minjson_tape_value_exists(child)) {
+            if (!same_value(minjson_tape_value_next(child),
+                            minjson_object_get(value, minjson_tape_value_get_string(child))))
+                return 0;
+            child = minjson_tape_value_next(minjson_tape_value_next(child));
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+/* The tape and the DOM of the same input must hold the same values */
+static int check_tape_matches_dom(void)
+{
+    static const char *inputs[] = {
+        "null", "true", "-12.5e-3", "\"\"", "[]", "{}",
+        "[[], {}, [[[]]], {\"a\": {\"b\": {}}}]",
+        "{\"s\": \"tab\\t quote\\\" slash\\/ \\u00e9\\u20ac\\ud83d\\ude00\", \"raw\": \"\xc3\xa9\",\n"
+        " \"n\": [0, -0, 1e308, 5e-324, -9223372036854775808, 18446744073709551615,\n"
+        "       18446744073709551616, 0.1, 123456789012345678],\n"
+        " \"b\": [true, false, null], \"o\": {\"x\": [1, {\"y\": [2, 3]}]}}"
+    };
+    struct minjson_error error;
+    struct minjson_tape *tape;
+    struct minjson *doc;
+    char *big;
+    size_t len;
+    size_t i;
+    int ok = 1;
+
+    /* Plus an object big enough to be indexed, holding nested arrays */
+    big = malloc(64 * 1024);
+    if (!big)
+        return -1;
+    len = sprintf(big, "{");
+    for (i = 0; i < 500; ++i)
+        len += sprintf(big + len, "%s\"key%lu\": [%lu, \"v%lu\", {\"i\": %lu.5}]",
+                       i ? ", " : "", (unsigned long)i, (unsigned long)i,
+                       (unsigned long)i, (unsigned long)i);
+    sprintf(big + len, "}");
+
+    for (i = 0; ok && i <= sizeof(inputs) / sizeof(inputs[0]); ++i) {
+        error = minjson_error_new();
+        doc = minjson_parse(NULL, i < sizeof(inputs) / sizeof(inputs[0]) ? inputs[i] : big, &error);
+        tape = minjson_parse_tape(NULL,
+                                  i < sizeof(inputs) / sizeof(inputs[0]) ? inputs[i] : big,
+                                  NULL,
+                                  &error);
+        ok = doc && tape && same_value(minjson_tape_root(tape), doc->root);
+        if (doc)
+            arena_allocator_destroy(doc->aallocator);
+        if (tape)
+            arena_allocator_destroy(tape->aallocator);
+    }
+    free(big);
+
+    return ok ? 0 : -1;
+}
+
+/* A reset arena keeps its chunks and hands them out again, without growing */
+static int check_arena_reset(void)
+{
+    struct arena_allocator_stats before, after;
+    struct arena_allocator *aa;
+    struct minjson_error error;
+    struct minjson *doc;
+    size_t i;
+    int ok = 1;
+
+    aa = arena_allocator_new(DEFAULT_ARENA_SIZE);
+    if (!aa)
+        return -1;
+
+    for (i = 0; i < 100; ++i)
+        ok = ok && arena_allocator_alloc(aa, DEFAULT_ALIGNMENT, 1024);
+    arena_allocator_get_stats(aa, &before);
+
+    arena_allocator_reset(aa, ARENA_RETAIN_ALL);
+    arena_allocator_get_stats(aa, &after);
+    ok = ok && before.chunk_count > 1 && after.used == 0 && after.padding == 0 &&
+         after.chunk_count == before.chunk_count && after.reserved == before.reserved;
+
+    for (i = 0; i < 100; ++i)
+        ok = ok && arena_allocator_alloc(aa, DEFAULT_ALIGNMENT, 1024);
+    arena_allocator_get_stats(aa, &after);
+    ok = ok && after.chunk_count == before.chunk_count && after.used == before.used;
+
+    /* Only the first arena is kept past a retain size of 0 */
+    arena_allocator_reset(aa, 0);
+    arena_allocator_get_stats(aa, &after);
+    ok = ok && after.chunk_count == 1 && after.reserved == DEFAULT_ARENA_SIZE;
+
+    /* One document after another in the same arena */
+    for (i = 0; ok && i < 3; ++i) {
+        error = minjson_error_new();
+        doc = minjson_parse(aa, "{\"a\": [1, 2, 3], \"b\": \"text\"}", &error);
+        ok = doc && minjson_value_get_int64(minjson_array_get(minjson_get(doc, "a"), 2)) == 3;
+        arena_allocator_reset(aa, ARENA_RETAIN_ALL);
+    }
+    arena_allocator_get_stats(aa, &after);
+    ok = ok && after.chunk_count == 1;
+
+    arena_allocator_destroy(aa);
+
+    return ok ? 0 : -1;
+}
+
+/* Rolling back to a mark frees what came after it, across chunks, and
+ * leaves what came before it alone. A failed parse into a caller's arena
+ * is rolled back the same way. */
+static int check_arena_mark_rollback(void)
+{
+    struct arena_allocator_stats marked, after;
+    struct arena_allocator *aa;
+    struct arena_mark mark;
+    struct minjson_error error;
+    char *kept, *first;
+    size_t i;
+    int ok = 1;
+
+    aa = arena_allocator_new(DEFAULT_ARENA_SIZE);
+    if (!aa)
+        return -1;
+
+    kept = arena_allocator_alloc(aa, 1, 64);
+    if (!kept) {
+        arena_allocator_destroy(aa);
+        return -1;
+    }
+    memset(kept, 'k', 64);
+
+    mark = arena_allocator_mark(aa);
+    arena_allocator_get_stats(aa, &marked);
+    first = arena_allocator_alloc(aa, DEFAULT_ALIGNMENT, 100);
+    for (i = 0; i < 50; ++i)
+        ok = ok && arena_allocator_alloc(aa, DEFAULT_ALIGNMENT, 1000);
+
+    arena_allocator_rollback_to(aa, mark);
+    arena_allocator_get_stats(aa, &after);
+    ok = ok && first && after.used == marked.used && after.padding == marked.padding;
+    /* The next allocation lands where the first one after the mark did */
+    ok = ok && arena_allocator_alloc(aa, DEFAULT_ALIGNMENT, 100) == first;
+    for (i = 0; i < 64; ++i)
+        ok = ok && kept[i] == 'k';
+
+    /* A parse that fails half way leaves doc_aa as it found it */
+    arena_allocator_get_stats(aa, &marked);
+    error = minjson_error_new();
+    ok = ok && !minjson_parse(aa, "{\"a\": [1, 2, \"three\"], \"b\": tru}", &error);
+    arena_allocator_get_stats(aa, &after);
+    ok = ok && after.used == marked.used && after.padding == marked.padding;
+
+    arena_allocator_destroy(aa);
+
+    return ok ? 0 : -1;
+}
+
+/* arena_allocator_get_stats counts bytes, padding, chunks and the high
+ * water mark, which survives a reset */
+static int check_arena_stats(void)
+{
+    struct arena_allocator_stats stats;
+    struct arena_allocator *aa;
+    struct minjson_error error;
+    struct minjson *doc;
+    int ok = 1;
+
+    aa = arena_allocator_new(DEFAULT_ARENA_SIZE);
+    if (!aa)
+        return -1;
+
+    arena_allocator_get_stats(aa, &stats);
+    ok = ok && stats.used == 0 && stats.padding == 0 && stats.chunk_count == 1 &&
+         stats.reserved == DEFAULT_ARENA_SIZE && stats.largest_chunk == DEFAULT_ARENA_SIZE;
+
+    /* 1 byte, then 7 bytes of padding to align the next 8 */
+    ok = ok && arena_allocator_alloc(aa, 1, 1) && arena_allocator_alloc(aa, 8, 8);
+    arena_allocator_get_stats(aa, &stats);
+    ok = ok && stats.used == 9 && stats.padding == 7 && stats.high_water == 16;
+
+    /* Too big for the first chunk, gets one of its own */
+    ok = ok && arena_allocator_alloc(aa, DEFAULT_ALIGNMENT, 3 * DEFAULT_ARENA_SIZE);
+    arena_allocator_get_stats(aa, &stats);
+    ok = ok && stats.chunk_count == 2 && stats.largest_chunk >= 3 * DEFAULT_ARENA_SIZE &&
+         stats.reserved == DEFAULT_ARENA_SIZE + stats.largest_chunk &&
+         stats.tail_waste == DEFAULT_ARENA_SIZE - 16;
+
+    arena_allocator_reset(aa, ARENA_RETAIN_ALL);
+    arena_allocator_get_stats(aa, &stats);
+    ok = ok && stats.used == 0 && stats.high_water == 16 + 3 * DEFAULT_ARENA_SIZE;
+
+    /* A document's footprint is what its parse took from the arena */
+    error = minjson_error_new();
+    doc = minjson_parse(aa, "{\"a\": [1, 2, 3]}", &error);
+    arena_allocator_get_stats(aa, &stats);
+    ok = ok && doc && doc->footprint > 0 && doc->footprint == stats.used + stats.padding &&
+         minjson_get_footprint(doc) == doc->footprint;
+
+    arena_allocator_destroy(aa);
+
+    return ok ? 0 : -1;
+}
+
+/* A static arena never grows past its buffer, reports how much was missing
+ * and is enough for a small document, scratch included */
+static int check_arena_static(void)
 {
-    struct arena_allocator *aa = arena_allocator_new(DEFAULT_ARENA_SIZE);
+    /* uint64_t keeps the buffer aligned */
+    static uint64_t buffer[2048 / sizeof(uint64_t)];
+    struct arena_allocator_stats stats;
+    struct minjson_parse_options options;
+    struct arena_allocator *aa;
+    struct minjson_error error;
+    struct minjson *doc;
+    size_t remaining;
+    int ok = 1;
+
+    ok = ok && !arena_allocator_new_static(buffer, 8);
 
-    /* No, this function is not included in the library.
-     * But basically, raw_json must be null terminated.*/
-    char *raw_json = read_from_file("src/example.json");
+    aa = arena_allocator_new_static(buffer, sizeof(buffer));
+    if (!aa)
+        return -1;
+
+    arena_allocator_get_stats(aa, &stats);
+    remaining = stats.reserved - stats.used - stats.padding;
+    ok = ok && arena_allocator_get_shortfall(aa) == 0 &&
+         !arena_allocator_alloc(aa, DEFAULT_ALIGNMENT, remaining + 100) &&
+         arena_allocator_get_shortfall(aa) == 100;
+    arena_allocator_get_stats(aa, &stats);
+    ok = ok && stats.chunk_count == 1 && stats.used == 0;
+
+    /* The document and its scratch both live in buffer */
+    options = minjson_parse_options_new();
+    options.scratch_aa = aa;
+    error = minjson_error_new();
+    doc = minjson_parse_ex(aa, "[1]", &options, &error);
+    ok = ok && doc && minjson_value_get_int64(minjson_array_get(doc->root, 0)) == 1 &&
+         (char *)doc->root > (char *)buffer &&
+         (char *)doc->root < (char *)buffer + sizeof(buffer);
 
+    /* Too big for what is left, fails with the shortfall instead of growing */
+    arena_allocator_reset(aa, ARENA_RETAIN_ALL);
+    error = minjson_error_new();
+    doc = minjson_parse_ex(aa,
+                           "[\"a string that is long enough\", \"and another one\", "
+                           "[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[["
+                           "[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[["
+                           "]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]"
+                           "]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]",
+                           &options,
+                           &error);
+    arena_allocator_get_stats(aa, &stats);
+    ok = ok && !doc && error.code == MJ_ERR_ALLOCATOR &&
+         arena_allocator_get_shortfall(aa) > 0 && stats.chunk_count == 1;
+
+    /* Leaves buffer alone */
+    arena_allocator_destroy(aa);
+
+    return ok ? 0 : -1;
+}
+
+int main(void)
+{
     struct minjson_error error;
     struct minjson *root;
     struct minjson_value *school;
     struct minjson_value *students;
     size_t n_students;
     size_t i;
+#if !ARENA_HAVE_MMAP
+    char *raw_json;
+    size_t len;
+#endif
 
     error = minjson_error_new();
-    root = minjson_parse(aa, raw_json, &error);
+#if ARENA_HAVE_MMAP
+    /* The file is mapped, not copied, and unmapped along with the document */
+    root = minjson_parse_file("src/example.json", NULL, &error);
+#else
+    /* minjson_parse_file needs mmap, read the file in a buffer instead.
+     * Strings are copied in the document, the buffer can go right away. */
+    raw_json = read_from_file("src/example.json", &len);
+    if (!raw_json) {
+        fprintf(stderr, "Error: could not read src/example.json\n");
+        exit(-1);
+    }
+    root = minjson_parse_n(NULL, raw_json, len, &error);
+    free(raw_json);
+#endif
     if (!root) {
-        free(raw_json);
-        arena_allocator_destroy(aa);
         fprintf(stderr, "Error: %s\n", error.message);
         exit(-1);
     }
@@ -83,21 +645,56 @@ int main(void)
         size_t n_scores = minjson_array_get_size(student_scores);
         size_t j;
 
-        /* Cast to int as JSON number is stored as double */
-        printf("ID: %d\n", (int)minjson_value_get_number(student_id));
+        /* Integers that fit in 64 bits are stored exactly, see minjson_value_is_int */
+        printf("ID: %d\n", (int)minjson_value_get_int64(student_id));
         printf("Name: %s\n", minjson_value_get_string(student_name));
         printf("Score: ");
 
         for (j = 0; j < n_scores; ++j) {
             struct minjson_value *score = minjson_array_get(student_scores, j);
-            printf("%d ", (int)minjson_value_get_number(score));
+            printf("%d ", (int)minjson_value_get_int64(score));
         }
 
         printf("\n\n");
     }
 
-    arena_allocator_destroy(aa);
-    free(raw_json);
+    arena_allocator_destroy(root->aallocator);
+
+    if (check_stream_escaped_string() == -1) {
+        fprintf(stderr, "Error: push parsing of an escaped string failed\n");
+        exit(-1);
+    }
+
+    if (check_numbers_against_strtod() == -1)
+        exit(-1);
+    if (check_integer_limits() == -1) {
+        fprintf(stderr, "Error: 64 bits integer limits are not exact\n");
+        exit(-1);
+    }
+    if (check_duplicate_keys() == -1) {
+        fprintf(stderr, "Error: a duplicate key policy was not applied\n");
+        exit(-1);
+    }
+    if (check_tape_matches_dom() == -1) {
+        fprintf(stderr, "Error: the tape and the DOM of the same input differ\n");
+        exit(-1);
+    }
+    if (check_arena_reset() == -1) {
+        fprintf(stderr, "Error: a reset arena did not reuse its chunks\n");
+        exit(-1);
+    }
+    if (check_arena_mark_rollback() == -1) {
+        fprintf(stderr, "Error: rolling back to an arena mark failed\n");
+        exit(-1);
+    }
+    if (check_arena_stats() == -1) {
+        fprintf(stderr, "Error: arena statistics are off\n");
+        exit(-1);
+    }
+    if (check_arena_static() == -1) {
+        fprintf(stderr, "Error: a static arena grew or misreported its shortfall\n");
+        exit(-1);
+    }
 
     return 0;
 }
@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+"""Generates src/minjson_pow10.h, the 128 bits powers of five used by the
+Eisel-Lemire conversion in src/minjson.c.
+
+    python3 tools/gen_pow10.py > src/minjson_pow10.h
+"""
+
+POW10_MIN = -342
+POW10_MAX = 308
+
+
+def pow5_128(q):
+    """5^q normalized to 128 bits, negative powers rounded up, positive
+    ones truncated. Negative powers are built as fast_float builds its
+    table: past 5^-27 the quotient is taken with twice the bits, rounded up
+    then truncated back to 128 bits."""
+    if q >= 0:
+        power = 5 ** q
+        shift = power.bit_length() - 128
+        return power >> shift if shift > 0 else power << -shift
+
+    divisor = 5 ** -q
+    z = divisor.bit_length()
+    b = z + 127 if q >= -27 else 2 * z + 128
+    value = (1 << b) // divisor + 1
+    while value >= 1 << 128:
+        value >>= 1
+    return value
+
+
+def main():
+    print("""#ifndef MINJSON_POW10_H
+#define MINJSON_POW10_H
+
+#include <stdint.h>
+
+/* 5^q for q in [MINJSON_POW10_MIN, MINJSON_POW10_MAX], normalized to 128 bits
+ * (most significant bit set) and stored as a high then a low 64 bits word.
+ * Negative powers are rounded up, positive ones truncated. Used by the
+ * Eisel-Lemire conversion in minjson.c. Generated by tools/gen_pow10.py,
+ * not meant to be edited by hand. */
+
+#define MINJSON_POW10_MIN (%d)
+#define MINJSON_POW10_MAX %d
+
+static const uint64_t minjson_pow5_128[2 * (MINJSON_POW10_MAX - MINJSON_POW10_MIN + 1)] = {"""
+          % (POW10_MIN, POW10_MAX))
+
+    for q in range(POW10_MIN, POW10_MAX + 1):
+        value = pow5_128(q)
+        assert value >> 127 == 1
+        print("    UINT64_C(0x%016x), UINT64_C(0x%016x)%s /* 5^%d */"
+              % (value >> 64, value & (2 ** 64 - 1),
+                 "," if q < POW10_MAX else " ", q))
+
+    print("""};
+
+#endif""")
+
+
+if __name__ == "__main__":
+    main()